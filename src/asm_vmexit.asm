@@ -6,7 +6,7 @@ guest_registers struct
   $rcx qword ?
   $rdx qword ?
   $rbx qword ?
-  qword ? ; padding
+  $saved qword ? ; guest_state bits, rsp lives in the vmcs
   $rbp qword ?
   $rsi qword ?
   $rdi qword ?
@@ -49,7 +49,46 @@ guest_registers struct
   $xmm15 oword ?
 guest_registers ends
 
+GUEST_STATE_XMM equ 1
+GUEST_STATE_CR  equ 2
+GUEST_STATE_DR  equ 4
+GUEST_STATE_ALL equ 7
+
+; VMX_EXIT_REASON_COUNT
+EXIT_REASON_COUNT equ 41h
+
+EXIT_REASON_CPUID  equ 0Ah
+EXIT_REASON_VMCALL equ 12h
+EXIT_REASON_RDTSCP equ 33h
+
+; vcpu_fast_exit, checked by static_asserts in vcpu.h
+FAST_TSC_OFFSET      equ 00h
+FAST_TSC_OVERHEAD    equ 08h
+FAST_MPERF_OVERHEAD  equ 10h
+FAST_HIDE_TIMER      equ 18h
+FAST_PING_RAX        equ 20h
+FAST_PING_RESULT     equ 28h
+FAST_EXIT_STORE      equ 30h
+FAST_ENTRY_LOAD      equ 38h
+FAST_GENERATION      equ 40h
+FAST_SEEN_GENERATION equ 48h
+FAST_MAILBOX         equ 50h
+FAST_TIMER_VALUE     equ 58h
+FAST_EXIT_STATS      equ 60h
+FAST_IDLE_TIMER      equ 68h
+
+; exit_reason_stats, checked in vcpu.h
+EXIT_REASON_STATS_SIZE equ 420h
+EXIT_REASON_STATS_FAST equ 08h
+
+; vcpu_mailbox, checked in mailbox.h
+MAILBOX_HEAD equ 00h
+MAILBOX_TAIL equ 40h
+
 extern ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z : proc
+extern vm_exit_save_profiles : byte
+extern vm_exit_fast_offset : qword
+extern vm_exit_fast_reasons : qword
 
 ; execution starts here after a vm-exit
 ?vm_exit@hv@@YAXXZ proc
@@ -73,13 +112,202 @@ extern ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z : proc
   mov guest_registers.$r14[rsp], r14
   mov guest_registers.$r15[rsp], r15
 
+  mov rdx, 4402h ; VMCS_EXIT_REASON
+  vmread rbx, rdx
+  movzx ebx, bx
+
+  ; cpuid, rdtsc(p) and the ping hypercall are served right here, without
+  ; touching the xmm, control or debug registers, unless their handling
+  ; was taken over with register_exit_handler or _observers
+  cmp ebx, 64
+  jae full_exit
+  mov rax, vm_exit_fast_reasons
+  bt rax, rbx
+  jnc full_exit
+
+  ; the vcpu is at fs:0, its fast path state at fs:[r12]
+  mov r12, vm_exit_fast_offset
+
+  ; anything skip_instruction or the dispatcher would have to fix up takes
+  ; the full path: a pending single-step, sti/mov ss blocking
+  mov rdx, 6820h ; VMCS_GUEST_RFLAGS
+  vmread rax, rdx
+  bt eax, 8
+  jc full_exit
+  mov rdx, 4824h ; VMCS_GUEST_INTERRUPTIBILITY_STATE
+  vmread rax, rdx
+  test eax, eax
+  jnz full_exit
+
+  ; fixed counter 2 needs the cpl check of hide_vm_exit_overhead
+  mov r13, fs:[r12 + FAST_EXIT_STORE]
+  bt qword ptr [r13 + 18h], 34 ; msr_exit_store.perf_global_ctrl
+  jc full_exit
+
+  ; ept flushes and mailbox requests are only handled by the full path
+  mov rax, fs:[r12 + FAST_GENERATION]
+  mov rax, [rax]
+  mov rdx, fs:[r12 + FAST_SEEN_GENERATION]
+  cmp rax, [rdx]
+  jne full_exit
+  mov r14, fs:[r12 + FAST_MAILBOX]
+  mov rax, [r14 + MAILBOX_HEAD]
+  cmp rax, [r14 + MAILBOX_TAIL]
+  jne full_exit
+
+  ; every other hypercall goes to the dispatcher
+  cmp ebx, EXIT_REASON_VMCALL
+  jne fast_rip
+  mov rax, guest_registers.$rax[rsp]
+  cmp rax, fs:[r12 + FAST_PING_RAX]
+  jne full_exit
+
+fast_rip:
+  ; crossing 4gb from below needs the long mode check of skip_instruction
+  mov rdx, 681Eh ; VMCS_GUEST_RIP
+  vmread r15, rdx
+  mov rdx, 440Ch ; VMCS_VMEXIT_INSTRUCTION_LENGTH
+  vmread rax, rdx
+  add rax, r15
+  shr r15, 32
+  jnz fast_rip_ok
+  mov rdx, rax
+  shr rdx, 32
+  jnz full_exit
+
+fast_rip_ok:
+  ; nothing can send the exit to the full path anymore
+  mov rdx, 681Eh ; VMCS_GUEST_RIP
+  vmwrite rdx, rax
+
+  imul rax, rbx, EXIT_REASON_STATS_SIZE
+  add rax, fs:[r12 + FAST_EXIT_STATS]
+  inc qword ptr [rax + EXIT_REASON_STATS_FAST]
+
+  cmp ebx, EXIT_REASON_CPUID
+  je fast_cpuid
+  cmp ebx, EXIT_REASON_VMCALL
+  je fast_ping
+  cmp ebx, EXIT_REASON_RDTSCP
+  je fast_rdtscp
+
+  rdtsc
+  mov guest_registers.$rax[rsp], rax
+  mov guest_registers.$rdx[rsp], rdx
+  jmp fast_no_hide
+
+fast_rdtscp:
+  rdtscp
+  mov guest_registers.$rax[rsp], rax
+  mov guest_registers.$rdx[rsp], rdx
+  mov guest_registers.$rcx[rsp], rcx
+  jmp fast_no_hide
+
+fast_ping:
+  mov rax, fs:[r12 + FAST_PING_RESULT]
+  mov guest_registers.$rax[rsp], rax
+  jmp fast_no_hide
+
+fast_cpuid:
+  mov eax, dword ptr guest_registers.$rax[rsp]
+  mov ecx, dword ptr guest_registers.$rcx[rsp]
+  cpuid
+  mov guest_registers.$rax[rsp], rax
+  mov guest_registers.$rbx[rsp], rbx
+  mov guest_registers.$rcx[rsp], rcx
+  mov guest_registers.$rdx[rsp], rdx
+
+  ; hide the exit from the guest's tsc, as hide_vm_exit_overhead does
+  mov rax, fs:[r12 + FAST_TSC_OVERHEAD]
+  cmp rax, 10000
+  ja fast_no_hide
+  mov rdx, fs:[r12 + FAST_TSC_OFFSET]
+  sub rdx, rax
+  mov rax, fs:[r12 + FAST_HIDE_TIMER]
+  jmp fast_timing
+
+fast_no_hide:
+  xor edx, edx
+  mov rax, fs:[r12 + FAST_IDLE_TIMER]
+
+fast_timing:
+  ; both fields only need a vmwrite when they change, the mirrored timer
+  ; value is stored first in case a doorbell nmi zeroes it in between
+  cmp rdx, fs:[r12 + FAST_TSC_OFFSET]
+  je fast_tsc_offset_set
+  mov fs:[r12 + FAST_TSC_OFFSET], rdx
+  mov rcx, 2010h ; VMCS_CTRL_TSC_OFFSET
+  vmwrite rcx, rdx
+
+fast_tsc_offset_set:
+  cmp rax, fs:[r12 + FAST_TIMER_VALUE]
+  je fast_timer_set
+  mov fs:[r12 + FAST_TIMER_VALUE], rax
+  mov rcx, 482Eh ; VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE
+  vmwrite rcx, rax
+
+fast_timer_set:
+  ; perf global ctrl and the aperf/mperf entry loads
+  mov rax, [r13 + 18h] ; msr_exit_store.perf_global_ctrl
+  mov rcx, 2808h ; VMCS_GUEST_PERF_GLOBAL_CTRL
+  vmwrite rcx, rax
+  mov rcx, fs:[r12 + FAST_ENTRY_LOAD]
+  mov rdx, fs:[r12 + FAST_MPERF_OVERHEAD]
+  mov rax, [r13 + 28h] ; msr_exit_store.aperf
+  sub rax, rdx
+  mov [rcx + 08h], rax ; msr_entry_load.aperf
+  mov rax, [r13 + 38h] ; msr_exit_store.mperf
+  sub rax, rdx
+  mov [rcx + 18h], rax ; msr_entry_load.mperf
+
+  ; a request posted since the check above may have lost its doorbell to
+  ; the timer write, exit again right after entry in that case
+  mov rax, [r14 + MAILBOX_HEAD]
+  cmp rax, [r14 + MAILBOX_TAIL]
+  je fast_resume
+  xor eax, eax
+  mov fs:[r12 + FAST_TIMER_VALUE], rax
+  mov rcx, 482Eh ; VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE
+  vmwrite rcx, rax
+
+fast_resume:
+  xor r15d, r15d
+  jmp restore_gprs
+
+full_exit:
+  ; volatile SSE registers, the C++ side is free to clobber these. xmm6-15
+  ; are callee-saved and survive handle_vm_exit unless a profile needs them
+  movaps guest_registers.$xmm0[rsp], xmm0
+  movaps guest_registers.$xmm1[rsp], xmm1
+  movaps guest_registers.$xmm2[rsp], xmm2
+  movaps guest_registers.$xmm3[rsp], xmm3
+  movaps guest_registers.$xmm4[rsp], xmm4
+  movaps guest_registers.$xmm5[rsp], xmm5
+
+  ; look up the save profile of this exit reason, unknown reasons get all
+  mov eax, ebx
+  mov ecx, GUEST_STATE_ALL
+  cmp eax, EXIT_REASON_COUNT
+  jae profile_found
+  lea rdx, vm_exit_save_profiles
+  movzx ecx, byte ptr [rdx + rax]
+profile_found:
+  mov guest_registers.$saved[rsp], rcx
+
+  test cl, GUEST_STATE_CR
+  jz skip_save_cr
+
   ; control registers
   mov rax, cr2
   mov guest_registers.$cr2[rsp], rax
   mov rax, cr8
   mov guest_registers.$cr8[rsp], rax
 
-  ; debug registers
+skip_save_cr:
+  test cl, GUEST_STATE_DR
+  jz skip_save_dr
+
+  ; debug registers, every move is serializing
   mov rax, dr0
   mov guest_registers.$dr0[rsp], rax
   mov rax, dr1
@@ -91,13 +319,11 @@ extern ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z : proc
   mov rax, dr6
   mov guest_registers.$dr6[rsp], rax
 
-  ; SSE registers
-  movaps guest_registers.$xmm0[rsp], xmm0
-  movaps guest_registers.$xmm1[rsp], xmm1
-  movaps guest_registers.$xmm2[rsp], xmm2
-  movaps guest_registers.$xmm3[rsp], xmm3
-  movaps guest_registers.$xmm4[rsp], xmm4
-  movaps guest_registers.$xmm5[rsp], xmm5
+skip_save_dr:
+  test cl, GUEST_STATE_XMM
+  jz skip_save_xmm
+
+  ; non-volatile SSE registers
   movaps guest_registers.$xmm6[rsp], xmm6
   movaps guest_registers.$xmm7[rsp], xmm7
   movaps guest_registers.$xmm8[rsp], xmm8
@@ -109,6 +335,7 @@ extern ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z : proc
   movaps guest_registers.$xmm14[rsp], xmm14
   movaps guest_registers.$xmm15[rsp], xmm15
 
+skip_save_xmm:
   ; first argument is the guest context
   mov rcx, rsp
 
@@ -117,13 +344,16 @@ extern ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z : proc
   call ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z
   add rsp, 28h
 
-  ; SSE registers
-  movaps xmm0, guest_registers.$xmm0[rsp]
-  movaps xmm1, guest_registers.$xmm1[rsp]
-  movaps xmm2, guest_registers.$xmm2[rsp]
-  movaps xmm3, guest_registers.$xmm3[rsp]
-  movaps xmm4, guest_registers.$xmm4[rsp]
-  movaps xmm5, guest_registers.$xmm5[rsp]
+  ; handle_vm_exit returns true if we should stop virtualization
+  mov r15, rax
+
+  ; the profile saved on the way in says what to put back
+  mov rcx, guest_registers.$saved[rsp]
+
+  test cl, GUEST_STATE_XMM
+  jz skip_load_xmm
+
+  ; non-volatile SSE registers
   movaps xmm6, guest_registers.$xmm6[rsp]
   movaps xmm7, guest_registers.$xmm7[rsp]
   movaps xmm8, guest_registers.$xmm8[rsp]
@@ -135,8 +365,9 @@ extern ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z : proc
   movaps xmm14, guest_registers.$xmm14[rsp]
   movaps xmm15, guest_registers.$xmm15[rsp]
 
-  ; handle_vm_exit returns true if we should stop virtualization
-  mov r15, rax
+skip_load_xmm:
+  test cl, GUEST_STATE_DR
+  jz skip_load_dr
 
   ; debug registers
   mov rax, guest_registers.$dr0[rsp]
@@ -150,12 +381,26 @@ extern ?handle_vm_exit@hv@@YA_NQEAUguest_registers@1@@Z : proc
   mov rax, guest_registers.$dr6[rsp]
   mov dr6, rax
 
+skip_load_dr:
+  test cl, GUEST_STATE_CR
+  jz skip_load_cr
+
   ; control registers
   mov rax, guest_registers.$cr2[rsp]
   mov cr2, rax
   mov rax, guest_registers.$cr8[rsp]
   mov cr8, rax
 
+skip_load_cr:
+  ; volatile SSE registers
+  movaps xmm0, guest_registers.$xmm0[rsp]
+  movaps xmm1, guest_registers.$xmm1[rsp]
+  movaps xmm2, guest_registers.$xmm2[rsp]
+  movaps xmm3, guest_registers.$xmm3[rsp]
+  movaps xmm4, guest_registers.$xmm4[rsp]
+  movaps xmm5, guest_registers.$xmm5[rsp]
+
+restore_gprs:
   ; general-purpose registers
   mov rax, guest_registers.$rax[rsp]
   mov rcx, guest_registers.$rcx[rsp]
@@ -9,8 +9,18 @@
 #define ADDRMASK_EPT_PML3_INDEX(_VAR_) (((_VAR_) & 0x7FC0000000ULL) >> 30)
 #define ADDRMASK_EPT_PML4_INDEX(_VAR_) (((_VAR_) & 0xFF8000000000ULL) >> 39)
 
+// bit 63 of a leaf or not-present entry, violations there always exit. only
+// hook ptes in the views of a vcpu with #ve enabled ever clear it
+#define EPT_SUPPRESS_VE (1ULL << 63)
+
 using namespace mtrr;
 
+static auto hook_bucket_of(u64 pfn) -> u64
+{
+	// fibonacci hashing, spreads the mostly sequential pfns of a hooked image
+	return (pfn * 0x9E3779B97F4A7C15ull) >> (64 - EPT_HOOK_INDEX_BITS);
+}
+
 auto ept_t::get_ept_pointer() -> ept_pointer
 {
 	ept_pointer vmx_eptp{};
@@ -22,106 +32,592 @@ auto ept_t::get_ept_pointer() -> ept_pointer
 	return vmx_eptp;
 }
 
-auto ept_t::start() -> void
+auto ept_t::get_ept_pointer(ept_view* view) -> ept_pointer
+{
+	auto vmx_eptp = this->get_ept_pointer();
+	vmx_eptp.page_frame_number = view->pml4_phys / PAGE_SIZE;
+
+	return vmx_eptp;
+}
+
+auto ept_t::start() -> bool
 {
-	this->used_free_pages = 0;
+	this->split_count = 0;
+	this->coalesce_count = 0;
+	this->retired_count = 0;
+	this->generation = 0;
+	this->change_count = 0;
 	this->dummy_page_pfn = MmGetPhysicalAddress(this->dummy_page).QuadPart >> 12;
+	this->hidden_table_pfn = MmGetPhysicalAddress(&this->hidden_table[0]).QuadPart >> 12;
+
+	ept_pte hidden_pte{};
+	hidden_pte.flags = 0;
+	hidden_pte.read_access = 1;
+	hidden_pte.write_access = 1;
+	hidden_pte.execute_access = 1;
+	hidden_pte.memory_type = MEMORY_TYPE_WRITE_BACK;
+	hidden_pte.suppress_ve = 1;
+	hidden_pte.page_frame_number = this->dummy_page_pfn;
+
+	__stosq(reinterpret_cast<uint64_t*>(&this->hidden_table[0]), hidden_pte.flags, EPT_PTE_ENTRY_COUNT);
 	this->plm4_phys = MmGetPhysicalAddress(const_cast<ept_pml4e*>(&this->pml4[0])).QuadPart;
 
+	__stosq(reinterpret_cast<uint64_t*>(&this->pml4[0]), EPT_SUPPRESS_VE, EPT_PML4E_ENTRY_COUNT);
+
 	this->hook_count = 0;
+	this->hook_watermark = 0;
 	this->hook_list = reinterpret_cast<ept_hook*>(ExAllocatePoolZero(NonPagedPool, sizeof(ept_hook) * MAX_EPT_HOOKS, HV_POOL_TAG));
 
-	mtrr_list mtrr_data{};
-	initialize_mtrr(mtrr_data);
+	if (!this->hook_list)
+	{
+		log_error("failed to allocate the ept hook list");
+		return false;
+	}
+
+	memset(this->hook_groups, 0, sizeof(this->hook_groups));
+	memset(this->hook_group_of, 0, sizeof(this->hook_group_of));
+	this->hook_groups[0].active = true;
+
+	if (!this->table_pool.initialize(TABLE_POOL_CHUNK, TABLE_POOL_LOW_WATER))
+		log_warning("failed to reserve ept paging structures");
+
+	if (!this->shadow_pool.initialize(SHADOW_POOL_CHUNK, SHADOW_POOL_LOW_WATER))
+		log_warning("failed to reserve ept hook shadow pages");
 
-	this->pml4[0].read_access = 1;
-	this->pml4[0].write_access = 1;
-	this->pml4[0].execute_access = 1;
-	this->pml4[0].page_frame_number = MmGetPhysicalAddress(&this->pdpt).QuadPart / PAGE_SIZE;
+	// a single node has nothing to gain from separate view pools
+	this->node_count = min(static_cast<u32>(KeQueryHighestNodeNumber()) + 1, static_cast<u32>(EPT_MAX_NODES));
+	this->replicate = EPT_REPLICATE_ON_NUMA && this->node_count > 1;
 
-	ept_pdpte temp_epdpte;
-	temp_epdpte.flags = 0;
-	temp_epdpte.read_access = 1;
-	temp_epdpte.write_access = 1;
-	temp_epdpte.execute_access = 1;
+	for (auto node = 0u; node < this->node_count && this->node_count > 1; ++node)
+	{
+		if (!this->view_pools[node].initialize(VIEW_POOL_CHUNK, VIEW_POOL_LOW_WATER, node))
+			log_warning("failed to reserve ept view tables on node %u", node);
+	}
+
+	// lowest slots are handed out first
+	this->free_hook_count = MAX_EPT_HOOKS;
+	for (auto i = 0; i < MAX_EPT_HOOKS; i++)
+	{
+		this->free_hooks[i] = static_cast<u16>(MAX_EPT_HOOKS - 1 - i);
+	}
+
+	cpuid_eax_80000008 cpuid_80000008;
+	__cpuid(reinterpret_cast<int*>(&cpuid_80000008), 0x80000008);
+
+	// a 4-level walk can't reach past 256tb
+	this->max_phys_addr = min(cpuid_80000008.eax.number_of_physical_address_bits, 48u);
+
+	this->mtrr_data = &this->mtrr_maps[0];
+	initialize_mtrr(*this->mtrr_data, static_cast<u32>(this->max_phys_addr));
 
-	__stosq(reinterpret_cast<uint64_t*>(&this->pdpt[0]), temp_epdpte.flags, EPT_PDPTE_ENTRY_COUNT);
+	log_info("mtrr map resolved into %u intervals", this->mtrr_data->count);
 
-	for (auto i = 0; i < EPT_PDPTE_ENTRY_COUNT; i++)
+	ia32_vmx_ept_vpid_cap_register ept_cap;
+	ept_cap.flags = __readmsr(IA32_VMX_EPT_VPID_CAP);
+
+	this->large_pages_1gb = ept_cap.pdpte_1gb_pages;
+
+	auto const ranges = MmGetPhysicalMemoryRanges();
+
+	auto populated = 0ull;
+	auto large_pages = 0ull;
+
+	if (!ranges)
 	{
-		this->pdpt[i].page_frame_number = MmGetPhysicalAddress(&this->pde[i][0]).QuadPart / PAGE_SIZE;
+		// without a ram map fall back to identity mapping everything up to
+		// the fixed size, the rest is still populated on first touch
+		log_warning("failed to query the physical memory map, mapping the first %llu gigabytes", EPT_FALLBACK_MAP_SIZE / 1_gb);
+
+		if (!this->populate_range(0, min(EPT_FALLBACK_MAP_SIZE, 1ull << this->max_phys_addr), populated, large_pages))
+			return false;
+	}
+	else
+	{
+		// only gigabytes backed by ram are mapped up front, mmio and everything
+		// else below max_phys_addr is populated on its first ept violation
+		for (auto range = ranges; range->BaseAddress.QuadPart || range->NumberOfBytes.QuadPart; ++range)
+		{
+			auto const base = static_cast<u64>(range->BaseAddress.QuadPart);
+			auto const end = base + static_cast<u64>(range->NumberOfBytes.QuadPart);
+
+			if (!this->populate_range(base, end, populated, large_pages))
+			{
+				ExFreePool(ranges);
+				return false;
+			}
+		}
+
+		ExFreePool(ranges);
 	}
 
-	ept_pde_2mb temp_epde{};
-	temp_epde.flags = 0;
-	temp_epde.read_access = 1;
-	temp_epde.write_access = 1;
-	temp_epde.execute_access = 1;
-	temp_epde.large_page = 1;
+	log_info("ept populated %llu gigabytes, %llu with 1gb pages", populated, large_pages);
 
-	__stosq(reinterpret_cast<uint64_t*>(this->pde), temp_epde.flags, EPT_PDPTE_ENTRY_COUNT * EPT_PDE_ENTRY_COUNT);
+	// a replicated view copies every pdpt with its directory list and every
+	// directory with its node and leaf list
+	auto pdpts = 0ull;
+	auto directories = 0ull;
 
-	for (auto i = 0; i < EPT_PDPTE_ENTRY_COUNT; i++)
+	for (auto i = 0u; i < EPT_PML4E_ENTRY_COUNT; ++i)
 	{
-		for (auto j = 0; j < EPT_PDE_ENTRY_COUNT; j++)
+		if (!this->pdpt_tables[i])
+			continue;
+
+		++pdpts;
+
+		for (auto j = 0u; j < EPT_PDPTE_ENTRY_COUNT; ++j)
 		{
-			this->pde[i][j].page_frame_number = (i * 512) + j;
-			this->pde[i][j].memory_type = mtrr_adjust_effective_memory_type(
-				mtrr_data, this->pde[i][j].page_frame_number * 2_mb, MEMORY_TYPE_WRITE_BACK);
+			if (this->directory_lists[i]->directories[j])
+				++directories;
 		}
 	}
 
+	this->view_reserve_pages = EPT_VIEW_HOOK_RESERVE + (this->replicate ? pdpts * 2 + directories * 3 : 0);
+
+	log_info("ept views reserve %llu pages each", this->view_reserve_pages);
 
 	log_info("ept started!");
+
+	return true;
+}
+
+// maps every gigabyte overlapping [base, end). runs at PASSIVE_LEVEL before
+// virtualization, so the pool may grow as needed. gigabytes mapped by an
+// earlier range are skipped, they aren't counted twice
+auto ept_t::populate_range(u64 const base, u64 const end, u64& populated, u64& large_pages) -> bool
+{
+	for (auto address = base & ~(1_gb - 1); address < end; address += 1_gb)
+	{
+		if (address >> this->max_phys_addr)
+			break;
+
+		auto result = this->populate(address);
+
+		while (result == ept_populate_failed)
+		{
+			if (!this->table_pool.grow(TABLE_POOL_CHUNK))
+			{
+				log_error("out of memory for ept paging structures");
+				return false;
+			}
+
+			result = this->populate(address);
+		}
+
+		if (result == ept_populate_present)
+			continue;
+
+		++populated;
+
+		if (!this->get_directory(address))
+			++large_pages;
+	}
+
+	return true;
 }
 
+// marks the translations of every vcpu stale, each one flushes before its
+// next vm-entry. several changes in a row cost a single flush per vcpu
 auto ept_t::invalidate() -> void
 {
-	auto ept_pointer = this->get_ept_pointer();
+	_InterlockedIncrement64(&this->generation);
+}
+
+// called right before vm-entry by a vcpu whose generation is behind, its
+// views catch up with the shared hierarchy before the flush
+auto ept_t::flush(vcpu_t* cpu) -> void
+{
+	auto const current = static_cast<u64>(this->generation);
+
+	auto active = true;
+
+	this->ept_lock.lock();
+
+	for (auto i = 0u; i < ept_view_count; ++i)
+	{
+		if (!cpu->views[i] || !this->sync_view(cpu->views[i], static_cast<ept_view_index>(i), cpu->ve_enabled))
+			active = false;
+	}
+
+	this->ept_lock.unlock();
+
+	cpu->views_active = active;
+
+	// an empty list makes a guest vmfunc exit instead of switching to a stale view
+	for (auto i = 0u; i < ept_view_count; ++i)
+	{
+		cpu->eptp_list[i] = active ? this->get_ept_pointer(cpu->views[i]).flags : 0;
+	}
+
+	auto ept_pointer = active ? cpu->eptp_list[ept_view_read] : this->get_ept_pointer().flags;
+
+	vmx::vm_write(VMCS_CTRL_EPT_POINTER, ept_pointer);
+
+	if (cpu->vmfunc_enabled)
+		vmx::vm_write(VMCS_CTRL_EPTP_INDEX, ept_view_read);
 
 	invept_descriptor descriptor{};
-	descriptor.ept_pointer = ept_pointer.flags;
 	descriptor.reserved = 0;
 
-	vmx::invept(invept_single_context, descriptor);
+	if (active)
+	{
+		for (auto i = 0u; i < ept_view_count; ++i)
+		{
+			descriptor.ept_pointer = cpu->eptp_list[i];
+			vmx::invept(invept_single_context, descriptor);
+		}
+	}
+	else
+	{
+		descriptor.ept_pointer = ept_pointer;
+		vmx::invept(invept_single_context, descriptor);
+	}
+
+	cpu->ept_generation = current;
+
+	if (this->retired_count)
+		this->reclaim_retired();
+}
+
+// a retired page goes back to its pool once every vcpu has flushed past
+// the generation it was unlinked in
+auto ept_t::reclaim_retired() -> void
+{
+	this->ept_lock.lock();
+	this->reclaim_retired_locked();
+	this->ept_lock.unlock();
+}
+
+// callers hold ept_lock
+auto ept_t::reclaim_retired_locked() -> void
+{
+	auto oldest = static_cast<u64>(this->generation);
+
+	for (auto i = 0u; i < ghv.vcpu_count; ++i)
+	{
+		oldest = min(oldest, ghv.vcpus[i]->ept_generation);
+	}
+
+	auto reclaimed = 0ull;
+
+	// retired in generation order, only ever a prefix is reclaimable
+	while (reclaimed < this->retired_count && this->retired_tables[reclaimed].generation <= oldest)
+	{
+		auto const& retired = this->retired_tables[reclaimed];
+
+		retired.pool->free(retired.table, retired.phys);
+		++reclaimed;
+	}
+
+	for (auto i = reclaimed; i < this->retired_count; ++i)
+	{
+		this->retired_tables[i - reclaimed] = this->retired_tables[i];
+	}
+
+	this->retired_count -= reclaimed;
+}
+
+auto ept_t::get_pdpte(u64 phys) -> ept_pdpte*
+{
+	auto const pdpt = this->pdpt_tables[ADDRMASK_EPT_PML4_INDEX(phys)];
+
+	if (!pdpt || (phys >> this->max_phys_addr))
+		return nullptr;
+
+	return &pdpt[ADDRMASK_EPT_PML3_INDEX(phys)];
+}
+
+auto ept_t::get_directory(u64 phys) -> ept_directory*
+{
+	auto const list = this->directory_lists[ADDRMASK_EPT_PML4_INDEX(phys)];
+
+	if (!list || (phys >> this->max_phys_addr))
+		return nullptr;
+
+	return list->directories[ADDRMASK_EPT_PML3_INDEX(phys)];
 }
 
 auto ept_t::get_pde_2mb(u64 phys) -> ept_pde_2mb*
 {
-	const auto directory = ADDRMASK_EPT_PML2_INDEX(phys);
-	const auto directory_pointer = ADDRMASK_EPT_PML3_INDEX(phys);
-	const auto pml4_entry = ADDRMASK_EPT_PML4_INDEX(phys);
+	auto const directory = this->get_directory(phys);
 
-	if (pml4_entry > 0)
+	// not populated or mapped by a 1gb page
+	if (!directory)
 	{
 		return nullptr;
 	}
 
-	return &this->pde[directory_pointer][directory];
+	return &directory->table[ADDRMASK_EPT_PML2_INDEX(phys)];
 }
 
 auto ept_t::get_pte(u64 phys) -> ept_pte*
 {
-	auto* pde_2mb = this->get_pde_2mb(phys);
+	auto const directory = this->get_directory(phys);
 
-	if (!pde_2mb || pde_2mb->large_page)
+	if (!directory)
+		return nullptr;
+
+	// a large page or the shared hidden table
+	auto const split = directory->split_list->splits[ADDRMASK_EPT_PML2_INDEX(phys)];
+
+	if (!split)
 		return nullptr;
 
-	const auto* pde = reinterpret_cast<ept_pde*>(pde_2mb);
+	return &split[ADDRMASK_EPT_PML1_INDEX(phys)];
+}
+
+// maps the gigabyte containing phys unless it already is. callers hold
+// ept_lock (or run before virtualization). only ept_populate_mapped changed
+// anything, the shared tables are untouched otherwise
+auto ept_t::populate(u64 phys) -> ept_populate_result
+{
+	if (phys >> this->max_phys_addr)
+		return ept_populate_failed;
+
+	auto const pml4_index = ADDRMASK_EPT_PML4_INDEX(phys);
+
+	if (!this->pdpt_tables[pml4_index])
+	{
+		u64 pdpt_phys = 0;
+		u64 list_phys = 0;
+
+		auto const pdpt = static_cast<ept_pdpte*>(this->table_pool.allocate(&pdpt_phys));
+		auto const list = static_cast<ept_directory_list*>(this->table_pool.allocate(&list_phys));
+
+		if (!pdpt || !list)
+		{
+			if (pdpt)
+				this->table_pool.free(pdpt, pdpt_phys);
+
+			if (list)
+				this->table_pool.free(list, list_phys);
+
+			return ept_populate_failed;
+		}
+
+		__stosq(reinterpret_cast<uint64_t*>(pdpt), EPT_SUPPRESS_VE, EPT_PDPTE_ENTRY_COUNT);
+		memset(list, 0, PAGE_SIZE);
+
+		this->pdpt_tables[pml4_index] = pdpt;
+		this->directory_lists[pml4_index] = list;
 
-	PHYSICAL_ADDRESS physical_address{};
-	physical_address.QuadPart = static_cast<LONGLONG>(pde->page_frame_number * PAGE_SIZE);
+		ept_pml4e pml4e{};
+		pml4e.flags = 0;
+		pml4e.read_access = 1;
+		pml4e.write_access = 1;
+		pml4e.execute_access = 1;
+		pml4e.page_frame_number = pdpt_phys / PAGE_SIZE;
 
-	auto* pte = static_cast<ept_pte*>(MmGetVirtualForPhysical(physical_address));
+		this->pml4[pml4_index].flags = pml4e.flags;
+	}
+
+	auto const pdpte = this->get_pdpte(phys);
+
+	if (pdpte->read_access)
+		return ept_populate_present;
+
+	auto const base = phys & ~(1_gb - 1);
+
+	// a whole gigabyte with one memory type needs no page directory
+	auto const gigabyte_type = this->mtrr_data->type_of(base, 1_gb);
+
+	if (gigabyte_type != MTRR_MIXED_TYPE && this->large_pages_1gb)
+	{
+		ept_pdpte_1gb pdpte_1gb{};
+		pdpte_1gb.flags = 0;
+		pdpte_1gb.read_access = 1;
+		pdpte_1gb.write_access = 1;
+		pdpte_1gb.execute_access = 1;
+		pdpte_1gb.large_page = 1;
+		pdpte_1gb.suppress_ve = 1;
+		pdpte_1gb.memory_type = gigabyte_type;
+		pdpte_1gb.page_frame_number = base / 1_gb;
+
+		pdpte->flags = pdpte_1gb.flags;
+		this->log_change(base, ept_change_pdpte);
+
+		return ept_populate_mapped;
+	}
+
+	ept_pde_2mb pml2_template{};
+	pml2_template.flags = 0;
+	pml2_template.read_access = 1;
+	pml2_template.write_access = 1;
+	pml2_template.execute_access = 1;
+	pml2_template.large_page = 1;
+	pml2_template.suppress_ve = 1;
+
+	auto const directory = this->create_directory(base, pml2_template);
+
+	if (!directory)
+		return ept_populate_failed;
+
+	// one sweep over the intervals overlapping this gigabyte
+	auto interval = this->mtrr_data->find(base);
+	auto mixed = false;
+
+	for (auto i = 0; i < EPT_PDE_ENTRY_COUNT; i++)
+	{
+		auto const address = base + (i * 2_mb);
+
+		while (this->mtrr_data->intervals[interval].end <= address)
+			++interval;
+
+		auto const& range = this->mtrr_data->intervals[interval];
+
+		// a mixed 2mb page stays uncacheable until it is split below
+		if (range.end < address + 2_mb)
+		{
+			directory->table[i].memory_type = MEMORY_TYPE_UNCACHEABLE;
+			mixed = true;
+		}
+		else
+		{
+			directory->table[i].memory_type = range.type;
+		}
+	}
+
+	this->link_directory(base, directory);
+
+	if (!mixed)
+		return ept_populate_mapped;
+
+	for (auto i = 0; i < EPT_PDE_ENTRY_COUNT; i++)
+	{
+		auto const address = base + (i * 2_mb);
+
+		if (this->mtrr_data->type_of(address, 2_mb) == MTRR_MIXED_TYPE)
+			this->split_mixed_page(address);
+	}
+
+	return ept_populate_mapped;
+}
+
+// gives every 4kb page of a 2mb range spanning several mtrr intervals its own
+// memory type. the split is never coalesced, the types aren't uniform
+auto ept_t::split_mixed_page(u64 phys) -> bool
+{
+	if (!this->split_large_page(phys))
+		return false;
+
+	auto const base = phys & ~(2_mb - 1);
+	auto const pte = this->get_pte(base);
 
 	if (!pte)
+		return false;
+
+	auto interval = this->mtrr_data->find(base);
+
+	for (auto i = 0; i < EPT_PTE_ENTRY_COUNT; i++)
+	{
+		auto const address = base + (i * PAGE_SIZE);
+
+		while (this->mtrr_data->intervals[interval].end <= address)
+			++interval;
+
+		pte[i].memory_type = this->mtrr_data->intervals[interval].type;
+	}
+
+	this->log_change(base, ept_change_pde);
+
+	return true;
+}
+
+// builds a directory of 2mb pages identity mapping the gigabyte at phys,
+// it is not reachable until link_directory()
+auto ept_t::create_directory(u64 phys, ept_pde_2mb pml2_template) -> ept_directory*
+{
+	u64 table_phys = 0;
+	u64 directory_phys = 0;
+	u64 split_list_phys = 0;
+
+	auto const table = static_cast<ept_pde_2mb*>(this->table_pool.allocate(&table_phys));
+	auto const directory = static_cast<ept_directory*>(this->table_pool.allocate(&directory_phys));
+	auto const split_list = static_cast<ept_split_list*>(this->table_pool.allocate(&split_list_phys));
+
+	if (!table || !directory || !split_list)
+	{
+		if (table)
+			this->table_pool.free(table, table_phys);
+
+		if (directory)
+			this->table_pool.free(directory, directory_phys);
+
+		if (split_list)
+			this->table_pool.free(split_list, split_list_phys);
+
 		return nullptr;
+	}
+
+	memset(directory, 0, sizeof(ept_directory));
+	memset(split_list, 0, sizeof(ept_split_list));
+
+	directory->table = table;
+	directory->table_phys = table_phys;
+	directory->self_phys = directory_phys;
+	directory->split_list = split_list;
+	directory->split_list_phys = split_list_phys;
+
+	__stosq(reinterpret_cast<uint64_t*>(table), pml2_template.flags, EPT_PDE_ENTRY_COUNT);
+
+	for (auto i = 0; i < EPT_PDE_ENTRY_COUNT; ++i)
+	{
+		table[i].page_frame_number = ((phys & ~(1_gb - 1)) / 2_mb) + i;
+	}
+
+	return directory;
+}
+
+auto ept_t::link_directory(u64 phys, ept_directory* directory) -> void
+{
+	ept_pdpte new_pointer{};
+	new_pointer.flags = 0;
+	new_pointer.read_access = 1;
+	new_pointer.write_access = 1;
+	new_pointer.execute_access = 1;
+	new_pointer.page_frame_number = directory->table_phys / PAGE_SIZE;
+
+	this->directory_lists[ADDRMASK_EPT_PML4_INDEX(phys)]->directories[ADDRMASK_EPT_PML3_INDEX(phys)] = directory;
+
+	this->get_pdpte(phys)->flags = new_pointer.flags;
+	this->log_change(phys, ept_change_pdpte);
+}
+
+auto ept_t::split_1gb_page(u64 phys) -> bool
+{
+	if (this->populate(phys) == ept_populate_failed)
+		return false;
+
+	if (this->get_directory(phys))
+		return true;
+
+	auto const pdpte_1gb = reinterpret_cast<ept_pdpte_1gb*>(this->get_pdpte(phys));
+
+	ept_pde_2mb pml2_template{};
+	pml2_template.flags = 0;
+	pml2_template.read_access = 1;
+	pml2_template.write_access = 1;
+	pml2_template.execute_access = 1;
+	pml2_template.large_page = 1;
+	pml2_template.memory_type = pdpte_1gb->memory_type;
+	pml2_template.ignore_pat = pdpte_1gb->ignore_pat;
+	pml2_template.suppress_ve = pdpte_1gb->suppress_ve;
+
+	auto const directory = this->create_directory(phys, pml2_template);
+
+	if (!directory)
+		return false;
+
+	this->link_directory(phys, directory);
 
-	return &pte[ADDRMASK_EPT_PML1_INDEX(phys)];
+	return true;
 }
 
 auto ept_t::split_large_page(u64 phys) -> bool
 {
+	// 1gb -> 2mb first, then 2mb -> 4kb
+	if (!this->split_1gb_page(phys))
+		return false;
+
 	auto* pde_2mb = this->get_pde_2mb(phys);
 
 	if (!pde_2mb)
@@ -130,16 +626,13 @@ auto ept_t::split_large_page(u64 phys) -> bool
 	if (!pde_2mb->large_page)
 		return true;
 
-	if (this->used_free_pages >= FREE_PAGES_SIZE)
-		return false;
-
-	auto const split = reinterpret_cast<ept_split*>(
-		&this->free_pages[this->used_free_pages]);
+	u64 split_phys = 0;
+	auto const split = static_cast<ept_split*>(this->table_pool.allocate(&split_phys));
 
 	if (!split)
 		return false;
 
-	++this->used_free_pages;
+	++this->split_count;
 
 	ept_pte pml1_template{};
 	pml1_template.flags = 0;
@@ -163,105 +656,1485 @@ auto ept_t::split_large_page(u64 phys) -> bool
 	new_pointer.write_access = 1;
 	new_pointer.execute_access = 1;
 
-	new_pointer.page_frame_number = MmGetPhysicalAddress(&split->pte[0]).QuadPart / PAGE_SIZE;
+	new_pointer.page_frame_number = split_phys / PAGE_SIZE;
+
+	// the table is complete before anyone can find it
+	this->get_directory(phys)->split_list->splits[ADDRMASK_EPT_PML2_INDEX(phys)] = split->pte;
 
 	pde_2mb->flags = new_pointer.flags;
+	this->log_change(phys, ept_change_pde);
 
 	return true;
 }
 
-auto ept_t::find_ept_hook(void* phys_addr)->ept_hook*
+// callers hold ept_lock. a reference is one pte of the split that no
+// longer maps its identity frame with the split's memory type
+auto ept_t::reference_split(u64 phys) -> void
 {
-	for (int i = 0; i < this->hook_count; ++i)
-	{
-		if (this->hook_list[i].physical_address == phys_addr)
-		{
-			return &this->hook_list[i];
-		}
-	}
+	auto const directory = this->get_directory(phys);
 
-	return nullptr;
+	if (directory)
+		++directory->split_refs[ADDRMASK_EPT_PML2_INDEX(phys)];
 }
 
-auto ept_t::remove_ept_hook(void* virt_addr) -> bool
+auto ept_t::release_split(u64 phys) -> void
 {
-	for (int i = 0; i < this->hook_count; ++i)
-	{
-		if (this->hook_list[i].virtual_address == virt_addr)
-		{
-			auto hook = &this->hook_list[i];
-
-			hook->target_page->flags = hook->original_page.flags;
-			hook->physical_address = 0;
-			hook->virtual_address = 0;
+	auto const directory = this->get_directory(phys);
 
-			//auto vmroot_cr3 = __readcr3();
+	if (!directory)
+		return;
 
-			//__writecr3(ghv.system_cr3.flags);
+	auto& refs = directory->split_refs[ADDRMASK_EPT_PML2_INDEX(phys)];
 
-			//vmx::unlock_pages(hook->mdl);
+	if (!refs || --refs)
+		return;
 
-			//__writecr3(vmroot_cr3);
-
-			hook->mdl = 0;
-
-			invalidate();
-
-			return true;
-		}
-	}
-
-	return false;
+	this->coalesce_large_page(phys);
 }
 
-auto ept_t::install_page_hook(ept_hint* hint) -> bool
+// folds an unreferenced split back into a 2mb mapping. the caller is
+// responsible for the invalidate() that also releases the table
+auto ept_t::coalesce_large_page(u64 phys) -> bool
 {
-	auto vmroot_cr3 = __readcr3();
+	auto* pde_2mb = this->get_pde_2mb(phys);
 
-	auto physical_page = PAGE_ALIGN(hint->physical_addr);
+	if (!pde_2mb || pde_2mb->large_page)
+		return false;
 
-	if (!physical_page)
+	if (this->retired_count >= RETIRED_TABLES_MAX)
 		return false;
 
-	__writecr3(ghv.system_cr3.flags);
+	auto const base = phys & ~(2_mb - 1);
+	auto const pte = this->get_pte(base);
 
-	ept_hook* hook_entry = find_ept_hook(physical_page);
+	if (!pte)
+		return false;
 
-	if (hook_entry)
+	// refs only say nothing is hooked or hidden, verify the table really
+	// is an identity map with one memory type before dropping it
+	for (auto i = 0; i < EPT_PTE_ENTRY_COUNT; ++i)
 	{
-		if (hook_entry->target_page->flags == hook_entry->original_page.flags)
+		if (pte[i].page_frame_number != (base / PAGE_SIZE) + i ||
+			!pte[i].read_access || !pte[i].write_access || !pte[i].execute_access ||
+			pte[i].memory_type != pte[0].memory_type ||
+			pte[i].ignore_pat != pte[0].ignore_pat ||
+			pte[i].suppress_ve != pte[0].suppress_ve)
 		{
-			memcpy(&hook_entry->fake_page[0], &hint->page_copy[0], PAGE_SIZE);
-
-			hook_entry->target_page->flags = hook_entry->rw_page.flags;
+			return false;
 		}
+	}
 
-		hook_entry->mdl = hint->mdl;
-
-		auto page_offset = (uintptr_t)hint->virtual_addr & (PAGE_SIZE - 1);
-		memcpy(hook_entry->fake_page + page_offset, hint->patch, hint->patch_size);
+	ept_pde_2mb large{};
+	large.flags = 0;
+	large.read_access = 1;
+	large.write_access = 1;
+	large.execute_access = 1;
+	large.large_page = 1;
+	large.memory_type = pte[0].memory_type;
+	large.ignore_pat = pte[0].ignore_pat;
+	large.suppress_ve = pte[0].suppress_ve;
+	large.page_frame_number = base / 2_mb;
 
-		return true;
-	}
+	auto const table_phys = reinterpret_cast<ept_pde*>(pde_2mb)->page_frame_number * PAGE_SIZE;
 
-	if (this->hook_count >= MAX_EPT_HOOKS)
-		return false;
+	pde_2mb->flags = large.flags;
+	this->log_change(phys, ept_change_pde);
 
-	if (!this->split_large_page((u64)physical_page))
-		return false;
+	this->get_directory(phys)->split_list->splits[ADDRMASK_EPT_PML2_INDEX(phys)] = nullptr;
 
-	hook_entry = &this->hook_list[this->hook_count];
+	this->retired_tables[this->retired_count].pool = &this->table_pool;
+	this->retired_tables[this->retired_count].table = pte;
+	this->retired_tables[this->retired_count].phys = table_phys;
+	this->retired_tables[this->retired_count].generation = static_cast<u64>(this->generation) + 1;
+	++this->retired_count;
 
-	this->hook_count += 1;
+	--this->split_count;
+	++this->coalesce_count;
+
+	return true;
+}
+
+// called from vmx-root after the guest wrote an mtrr. the mtrrs of this core
+// are read back and only mappings whose effective type changed are touched.
+// every core runs the update protocol itself, so each one ends up here and
+// flushes its own translations, later ones simply find nothing to change
+auto ept_t::update_memory_types() -> void
+{
+	ia32_mtrr_def_type_register mtrr_def_type{};
+	mtrr_def_type.flags = __readmsr(IA32_MTRR_DEF_TYPE);
+
+	// the protocol turns the mtrrs off (with caching disabled) while it
+	// reprograms them, the new layout is picked up once they're back on
+	if (!mtrr_def_type.mtrr_enable)
+		return;
+
+	this->ept_lock.lock();
+
+	auto const previous = this->mtrr_data;
+	auto const next = (previous == &this->mtrr_maps[0]) ? &this->mtrr_maps[1] : &this->mtrr_maps[0];
+
+	initialize_mtrr(*next, static_cast<u32>(this->max_phys_addr));
+
+	this->mtrr_data = next;
+
+	// both maps cover [0, max_phys_addr), walk them side by side
+	auto const top = 1ull << this->max_phys_addr;
+	auto address = 0ull;
+	auto changed = false;
+
+	for (auto i = 0u, j = 0u; address < top;)
+	{
+		auto const& before = previous->intervals[i];
+		auto const& after = next->intervals[j];
+		auto const end = min(before.end, after.end);
+
+		if (before.type != after.type)
+			changed |= this->retype_range(address, end);
+
+		if (before.end == end)
+			++i;
+
+		if (after.end == end)
+			++j;
+
+		address = end;
+	}
+
+	this->ept_lock.unlock();
+
+	// the cores after the first find their types already in place
+	if (changed)
+		this->invalidate();
+}
+
+// callers hold ept_lock. gigabytes that aren't populated yet get the new
+// types whenever they are. returns whether any mapping was touched
+auto ept_t::retype_range(u64 base, u64 end) -> bool
+{
+	auto changed = false;
+
+	for (auto address = base & ~(2_mb - 1); address < end;)
+	{
+		auto const next_gigabyte = (address & ~(1_gb - 1)) + 1_gb;
+		auto const pdpte = this->get_pdpte(address);
+
+		if (!pdpte || !pdpte->read_access)
+		{
+			address = next_gigabyte;
+			continue;
+		}
+
+		if (!this->get_directory(address))
+		{
+			auto const type = this->mtrr_data->type_of(address & ~(1_gb - 1), 1_gb);
+
+			if (type != MTRR_MIXED_TYPE)
+			{
+				auto const pdpte_1gb = reinterpret_cast<ept_pdpte_1gb*>(pdpte);
+
+				if (pdpte_1gb->memory_type != type)
+				{
+					pdpte_1gb->memory_type = type;
+					this->log_change(address, ept_change_pdpte);
+
+					changed = true;
+				}
+
+				address = next_gigabyte;
+				continue;
+			}
+
+			// pool is dry, the gigabyte keeps its stale type for now
+			if (!this->split_1gb_page(address))
+			{
+				address = next_gigabyte;
+				continue;
+			}
+
+			changed = true;
+		}
+
+		changed |= this->retype_large_page(address);
+
+		address += 2_mb;
+	}
+
+	return changed;
+}
+
+// retypes one 2mb range, splitting it when it became mixed and folding an
+// unreferenced split back when it became uniform. returns whether any
+// mapping was touched
+auto ept_t::retype_large_page(u64 phys) -> bool
+{
+	auto const base = phys & ~(2_mb - 1);
+	auto const pde_2mb = this->get_pde_2mb(base);
+
+	if (!pde_2mb)
+		return false;
+
+	auto const type = this->mtrr_data->type_of(base, 2_mb);
+
+	if (pde_2mb->large_page)
+	{
+		if (type != MTRR_MIXED_TYPE)
+		{
+			if (pde_2mb->memory_type == type)
+				return false;
+
+			pde_2mb->memory_type = type;
+			this->log_change(base, ept_change_pde);
+
+			return true;
+		}
+
+		pde_2mb->memory_type = MEMORY_TYPE_UNCACHEABLE;
+		this->log_change(base, ept_change_pde);
+		this->split_mixed_page(base);
+
+		return true;
+	}
+
+	auto const pte = this->get_pte(base);
+
+	if (!pte)
+		return false;
+
+	auto changed = false;
+	auto interval = this->mtrr_data->find(base);
+
+	for (auto i = 0; i < EPT_PTE_ENTRY_COUNT; i++)
+	{
+		auto const address = base + (i * PAGE_SIZE);
+
+		while (this->mtrr_data->intervals[interval].end <= address)
+			++interval;
+
+		auto const page_type = this->mtrr_data->intervals[interval].type;
+
+		// hidden pages map the dummy page, its type doesn't follow the mtrrs
+		if (pte[i].page_frame_number == this->dummy_page_pfn)
+			continue;
+
+		if (pte[i].memory_type != page_type)
+		{
+			pte[i].memory_type = page_type;
+			changed = true;
+		}
+
+		// the live pte is any one of the saved copies (or a single step
+		// variant of the original), all of them follow the new type so the
+		// next switch or group toggle doesn't bring the old one back
+		if (auto const hook = this->lookup_hook(address / PAGE_SIZE))
+		{
+			hook->original_page.memory_type = page_type;
+			hook->rw_page.memory_type = page_type;
+			hook->exec_page.memory_type = page_type;
+		}
+	}
+
+	if (changed)
+		this->log_change(base, ept_change_pde);
+
+	auto const directory = this->get_directory(base);
+
+	if (type != MTRR_MIXED_TYPE && !directory->split_refs[ADDRMASK_EPT_PML2_INDEX(base)])
+		changed |= this->coalesce_large_page(base);
+
+	return changed;
+}
+
+auto ept_t::refill_pools() -> void
+{
+	this->table_pool.refill();
+	this->shadow_pool.refill();
+
+	for (auto node = 0u; node < this->node_count && this->node_count > 1; ++node)
+	{
+		this->view_pools[node].refill();
+	}
+}
+
+auto ept_t::is_hidden(const ept_pde_2mb* pde_2mb) -> bool
+{
+	return !pde_2mb->large_page && reinterpret_cast<const ept_pde*>(pde_2mb)->page_frame_number == this->hidden_table_pfn;
+}
+
+// callers hold ept_lock with the system cr3 loaded
+auto ept_t::hide_page(u64 phys) -> bool
+{
+	if (!this->split_large_page(phys))
+		return false;
+
+	auto const pte = this->get_pte(phys);
+
+	if (!pte)
+	{
+		auto const pde_2mb = this->get_pde_2mb(phys);
+
+		return pde_2mb && this->is_hidden(pde_2mb);
+	}
+
+	if (pte->page_frame_number != this->dummy_page_pfn)
+	{
+		pte->page_frame_number = this->dummy_page_pfn;
+		this->reference_split(phys);
+		this->log_change(phys, ept_change_pte);
+	}
+
+	return true;
+}
+
+// hides a whole 2mb range without a split table of its own, the pde is
+// pointed at the shared hidden table. a range that already is split (hooks,
+// mixed types) is hidden page by page so the existing ptes stay valid
+auto ept_t::hide_large_page(u64 phys) -> bool
+{
+	auto const base = phys & ~(2_mb - 1);
+
+	if (!this->split_1gb_page(base))
+		return false;
+
+	auto const pde_2mb = this->get_pde_2mb(base);
+
+	if (!pde_2mb)
+		return false;
+
+	if (this->is_hidden(pde_2mb))
+		return true;
+
+	if (!pde_2mb->large_page)
+	{
+		for (auto i = 0ull; i < EPT_PTE_ENTRY_COUNT; ++i)
+		{
+			if (!this->hide_page(base + i * PAGE_SIZE))
+				return false;
+		}
+
+		return true;
+	}
+
+	ept_pde hidden{};
+	hidden.flags = 0;
+	hidden.read_access = 1;
+	hidden.write_access = 1;
+	hidden.execute_access = 1;
+	hidden.page_frame_number = this->hidden_table_pfn;
+
+	pde_2mb->flags = hidden.flags;
+	this->log_change(base, ept_change_pde);
+
+	return true;
+}
+
+// callers hold ept_lock with the system cr3 loaded and invalidate once
+// afterwards. aligned 2mb chunks take no tables, only the unaligned edges
+// are split. returns the number of bytes hidden from the (page aligned)
+// start, short of the full range when the table pool ran dry
+auto ept_t::hide_range(u64 phys, u64 size) -> u64
+{
+	auto const first = phys & ~(PAGE_SIZE - 1);
+	auto const last = (phys + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	if (!size || last <= first || (last - 1) >> this->max_phys_addr)
+		return 0;
+
+	auto address = first;
+
+	while (address < last)
+	{
+		if (!(address & (2_mb - 1)) && last - address >= 2_mb)
+		{
+			if (!this->hide_large_page(address))
+				break;
+
+			address += 2_mb;
+			continue;
+		}
+
+		if (!this->hide_page(address))
+			break;
+
+		address += PAGE_SIZE;
+	}
+
+	return address - first;
+}
+
+static auto pool_stats(const page_pool& pool, ept_pool_stats& stats) -> void
+{
+	stats.total_pages += pool.total_pages;
+	stats.free_pages += pool.free_pages;
+	stats.peak_used_pages += pool.peak_used_pages;
+	stats.failed_allocations += pool.failed_allocations;
+	stats.chunk_count += pool.chunk_count;
+}
+
+// callers hold ept_lock. counters of the hidden pages are derived from the
+// tables rather than kept, they are walked once per call
+auto ept_t::collect_stats(ept_stats& stats) -> void
+{
+	stats.version = EPT_STATS_VERSION;
+	stats.size = sizeof(ept_stats);
+
+	stats.generation = static_cast<u64>(this->generation);
+	stats.max_phys_addr = this->max_phys_addr;
+	stats.node_count = this->node_count;
+
+	stats.split_count = this->split_count;
+	stats.coalesce_count = this->coalesce_count;
+	stats.retired_count = this->retired_count;
+
+	for (auto i = 0u; i < EPT_PML4E_ENTRY_COUNT; ++i)
+	{
+		if (!this->directory_lists[i])
+			continue;
+
+		for (auto j = 0u; j < EPT_PDPTE_ENTRY_COUNT; ++j)
+		{
+			auto const directory = this->directory_lists[i]->directories[j];
+
+			if (!directory)
+				continue;
+
+			for (auto k = 0u; k < EPT_PDE_ENTRY_COUNT; ++k)
+			{
+				if (this->is_hidden(&directory->table[k]))
+				{
+					++stats.hidden_large_pages;
+					continue;
+				}
+
+				auto const split = directory->split_list->splits[k];
+
+				if (!split)
+					continue;
+
+				for (auto l = 0u; l < EPT_PTE_ENTRY_COUNT; ++l)
+				{
+					if (split[l].page_frame_number == this->dummy_page_pfn)
+						++stats.hidden_pages;
+				}
+			}
+		}
+	}
+
+	stats.hook_count = this->hook_count;
+	stats.hook_watermark = this->hook_watermark;
+	stats.hook_holes = this->hook_watermark - this->hook_count;
+	stats.free_hook_count = this->free_hook_count;
+
+	for (auto i = 1u; i < EPT_HOOK_GROUPS_MAX; ++i)
+	{
+		if (!this->hook_groups[i].name)
+			continue;
+
+		++stats.hook_groups;
+
+		if (this->hook_groups[i].active)
+			++stats.active_hook_groups;
+	}
+
+	for (auto i = 0ull; i < this->hook_watermark; ++i)
+	{
+		if (!this->hook_list[i].physical_address)
+			continue;
+
+		stats.hook_violations += this->hook_states[i].flips;
+
+		if (this->hook_states[i].single_step)
+			++stats.single_stepped_hooks;
+	}
+
+	pool_stats(this->table_pool, stats.table_pool);
+	pool_stats(this->shadow_pool, stats.shadow_pool);
+
+	for (auto node = 0u; node < this->node_count && this->node_count > 1; ++node)
+	{
+		pool_stats(this->view_pools[node], stats.view_pools);
+	}
+
+	stats.view_full_builds = this->view_full_builds;
+	stats.view_syncs = this->view_syncs;
+	stats.view_changes_replayed = this->view_changes_replayed;
+	stats.view_failures = this->view_failures;
+	stats.view_reserve_pages = this->view_reserve_pages;
+
+	for (auto i = 0u; i < ghv.vcpu_count; ++i)
+	{
+		if (!ghv.vcpus[i]->views_active)
+			++stats.vcpus_on_shared_tables;
+	}
+}
+
+// callers hold ept_lock with the system cr3 loaded. returns the records written
+auto ept_t::dump_hooks(ept_hook_record* records, u64 capacity) -> u64
+{
+	auto count = 0ull;
+
+	for (auto i = 0ull; i < this->hook_watermark && count < capacity; ++i)
+	{
+		auto const hook = &this->hook_list[i];
+
+		if (!hook->physical_address)
+			continue;
+
+		auto& record = records[count++];
+
+		record.physical_address = reinterpret_cast<u64>(hook->physical_address);
+		record.virtual_address = reinterpret_cast<u64>(hook->virtual_address);
+		record.violations = this->hook_states[i].flips;
+		record.index = static_cast<u16>(i);
+		record.group = this->hook_group_of[i];
+		record.active = this->hook_live(i);
+		record.single_step = this->hook_states[i].single_step;
+	}
+
+	return count;
+}
+
+// callers hold ept_lock with the system cr3 loaded. returns the records written
+auto ept_t::dump_splits(ept_split_record* records, u64 capacity) -> u64
+{
+	auto count = 0ull;
+
+	for (auto i = 0u; i < EPT_PML4E_ENTRY_COUNT; ++i)
+	{
+		if (!this->directory_lists[i])
+			continue;
+
+		for (auto j = 0u; j < EPT_PDPTE_ENTRY_COUNT; ++j)
+		{
+			auto const directory = this->directory_lists[i]->directories[j];
+
+			if (!directory)
+				continue;
+
+			for (auto k = 0u; k < EPT_PDE_ENTRY_COUNT; ++k)
+			{
+				if (!directory->split_list->splits[k])
+					continue;
+
+				if (count >= capacity)
+					return count;
+
+				auto& record = records[count++];
+
+				record.base = (static_cast<u64>(i) << 39) | (static_cast<u64>(j) << 30) | (static_cast<u64>(k) << 21);
+				record.refs = directory->split_refs[k];
+			}
+		}
+	}
+
+	return count;
+}
+
+auto ept_t::index_hook(u64 pfn, u16 hook_index) -> void
+{
+	ept_hook_bucket bucket{};
+	bucket.pfn = pfn;
+	bucket.hook_index = hook_index;
+
+	// filling an empty bucket is a single store, readers need no retry
+	for (auto i = hook_bucket_of(pfn);; i = (i + 1) & EPT_HOOK_INDEX_MASK)
+	{
+		if (!this->hook_index[i].flags)
+		{
+			this->hook_index[i].flags = bucket.flags;
+			return;
+		}
+	}
+}
+
+auto ept_t::unindex_hook(u64 pfn) -> void
+{
+	auto hole = hook_bucket_of(pfn);
+
+	while (this->hook_index[hole].flags && this->hook_index[hole].pfn != pfn)
+		hole = (hole + 1) & EPT_HOOK_INDEX_MASK;
+
+	if (!this->hook_index[hole].flags)
+		return;
+
+	this->hook_seq.write_begin();
+
+	// backward-shift deletion, keeps every probe chain intact without tombstones
+	for (auto i = (hole + 1) & EPT_HOOK_INDEX_MASK; this->hook_index[i].flags; i = (i + 1) & EPT_HOOK_INDEX_MASK)
+	{
+		auto const home = hook_bucket_of(this->hook_index[i].pfn);
+
+		if (((i - home) & EPT_HOOK_INDEX_MASK) >= ((i - hole) & EPT_HOOK_INDEX_MASK))
+		{
+			this->hook_index[hole].flags = this->hook_index[i].flags;
+			hole = i;
+		}
+	}
+
+	this->hook_index[hole].flags = 0;
+
+	this->hook_seq.write_end();
+}
+
+auto ept_t::lookup_hook(u64 pfn) -> ept_hook*
+{
+	for (;;)
+	{
+		auto const seq = this->hook_seq.read_begin();
+
+		ept_hook* hook = nullptr;
+
+		for (auto i = hook_bucket_of(pfn);; i = (i + 1) & EPT_HOOK_INDEX_MASK)
+		{
+			auto const bucket = this->hook_index[i];
+
+			if (!bucket.flags)
+				break;
+
+			if (bucket.pfn == pfn)
+			{
+				hook = &this->hook_list[bucket.hook_index];
+				break;
+			}
+		}
+
+		if (!this->hook_seq.read_retry(seq))
+			return hook;
+	}
+}
+
+// callers hold ept_lock. records a changed shared entry, views resync it on
+// their next flush. a repeat of the last change is dropped
+auto ept_t::log_change(u64 phys, ept_change_level level, u16 hook_index) -> void
+{
+	auto const mask = level == ept_change_pdpte ? ~(1_gb - 1) : level == ept_change_pde ? ~(2_mb - 1) : ~(PAGE_SIZE - 1);
+
+	phys &= mask;
+
+	if (this->change_count)
+	{
+		auto const& last = this->change_log[(this->change_count - 1) & EPT_CHANGE_LOG_MASK];
+
+		if (last.phys == phys && last.level == level && last.hook_index == hook_index)
+			return;
+	}
+
+	auto& change = this->change_log[this->change_count & EPT_CHANGE_LOG_MASK];
+	change.phys = phys;
+	change.hook_index = hook_index;
+	change.level = level;
+
+	++this->change_count;
+}
+
+// PASSIVE_LEVEL, ept_view_count per vcpu. views are built on the first
+// vm-entry, the pool is grown by what a build is expected to take
+auto ept_t::create_view(u32 node) -> ept_view*
+{
+	auto const view = static_cast<ept_view*>(allocate_on_node(sizeof(ept_view), node));
+
+	if (!view)
+		return nullptr;
+
+	view->pml4_phys = MmGetPhysicalAddress(&view->pml4[0]).QuadPart;
+	view->pool = (this->node_count > 1 && node < this->node_count) ? &this->view_pools[node] : &this->table_pool;
+
+	if (!view->pool->grow(this->view_reserve_pages))
+		log_warning("failed to reserve %llu pages for an ept view", this->view_reserve_pages);
+
+	return view;
+}
+
+// callers hold ept_lock. replays the changes since the last sync, a view
+// that never was built, fell behind the log or switched #ve delivery is
+// built from scratch instead
+auto ept_t::sync_view(ept_view* view, ept_view_index index, bool deliver_ve) -> bool
+{
+	if (!view->built || view->deliver_ve != deliver_ve ||
+		this->change_count - view->synced_changes > EPT_CHANGE_LOG_SIZE)
+	{
+		if (this->build_view(view, index, deliver_ve))
+			return true;
+
+		++this->view_failures;
+
+		return false;
+	}
+
+	if (view->synced_changes == this->change_count)
+		return true;
+
+	++this->view_syncs;
+
+	for (auto i = view->synced_changes; i < this->change_count; ++i)
+	{
+		if (!this->sync_change(view, index, this->change_log[i & EPT_CHANGE_LOG_MASK]))
+		{
+			view->built = false;
+			++this->view_failures;
+
+			return false;
+		}
+
+		++this->view_changes_replayed;
+	}
+
+	view->synced_changes = this->change_count;
+
+	return true;
+}
+
+// callers hold ept_lock. on multi-node machines every pdpt and directory is
+// copied so upper level walks stay on the vcpu's node
+auto ept_t::build_view(ept_view* view, ept_view_index index, bool deliver_ve) -> bool
+{
+	this->release_view(view);
+
+	view->deliver_ve = deliver_ve;
+	++this->view_full_builds;
+
+	for (auto i = 0ull; i < EPT_PML4E_ENTRY_COUNT && this->replicate; ++i)
+	{
+		if (!this->pdpt_tables[i])
+			continue;
+
+		if (!this->view_pdpt(view, i << 39))
+			return false;
+
+		for (auto j = 0ull; j < EPT_PDPTE_ENTRY_COUNT; ++j)
+		{
+			if (this->directory_lists[i]->directories[j] && !this->view_directory(view, (i << 39) | (j << 30)))
+				return false;
+		}
+	}
+
+	for (auto i = 0ull; i < this->hook_watermark; ++i)
+	{
+		if (!this->hook_list[i].physical_address || !this->hook_live(i))
+			continue;
+
+		if (!this->apply_hook(view, index, i))
+			return false;
+	}
+
+	view->synced_changes = this->change_count;
+	view->built = true;
+
+	return true;
+}
+
+// frees every private table, the view shares everything with ept_t again
+auto ept_t::release_view(ept_view* view) -> void
+{
+	for (auto i = 0u; i < EPT_PML4E_ENTRY_COUNT; ++i)
+	{
+		auto const list = view->directory_lists[i];
+
+		if (!list)
+			continue;
+
+		// hook ptes are all cleared below, no need to look for them
+		for (auto j = 0u; j < EPT_PDPTE_ENTRY_COUNT; ++j)
+		{
+			auto const directory = list->directories[j];
+
+			if (!directory)
+				continue;
+
+			for (auto k = 0u; k < EPT_PDE_ENTRY_COUNT; ++k)
+			{
+				auto const leaf = directory->leaf_list->splits[k];
+
+				if (leaf)
+					this->view_free(view, leaf, reinterpret_cast<ept_pde*>(&directory->table[k])->page_frame_number * PAGE_SIZE);
+			}
+
+			auto const self_phys = directory->self_phys;
+
+			this->view_free(view, directory->leaf_list, directory->leaf_list_phys);
+			this->view_free(view, directory->table, directory->table_phys);
+			this->view_free(view, directory, self_phys);
+		}
+
+		this->view_free(view, list, view->directory_list_phys[i]);
+		this->view_free(view, view->pdpts[i], view->pml4[i].page_frame_number * PAGE_SIZE);
+
+		view->directory_lists[i] = nullptr;
+		view->pdpts[i] = nullptr;
+	}
+
+	memset(view->hook_ptes, 0, sizeof(view->hook_ptes));
+	memcpy(view->pml4, this->pml4, sizeof(view->pml4));
+
+	view->built = false;
+}
+
+// copies a shared table into a page of the view, table nullptr for a
+// zeroed one
+auto ept_t::view_copy(ept_view* view, const void* table, u64* phys) -> void*
+{
+	auto const page = view->pool->allocate(phys);
+
+	if (!page)
+		return nullptr;
+
+	if (table)
+		memcpy(page, table, PAGE_SIZE);
+	else
+		memset(page, 0, PAGE_SIZE);
+
+	++view->page_count;
+
+	return page;
+}
+
+auto ept_t::view_free(ept_view* view, void* page, u64 phys) -> void
+{
+	view->pool->free(page, phys);
+	--view->page_count;
+}
+
+// the view's own pdpt of the 512gb around phys, copied on first use
+auto ept_t::view_pdpt(ept_view* view, u64 phys) -> ept_pdpte*
+{
+	auto const pml4_index = ADDRMASK_EPT_PML4_INDEX(phys);
+
+	if (view->pdpts[pml4_index])
+		return view->pdpts[pml4_index];
+
+	if (!this->pdpt_tables[pml4_index])
+		return nullptr;
+
+	u64 pdpt_phys = 0;
+	u64 list_phys = 0;
+
+	auto const pdpt = static_cast<ept_pdpte*>(this->view_copy(view, this->pdpt_tables[pml4_index], &pdpt_phys));
+	auto const list = static_cast<ept_view_directory_list*>(this->view_copy(view, nullptr, &list_phys));
+
+	if (!pdpt || !list)
+	{
+		if (pdpt)
+			this->view_free(view, pdpt, pdpt_phys);
+
+		if (list)
+			this->view_free(view, list, list_phys);
+
+		return nullptr;
+	}
+
+	view->pdpts[pml4_index] = pdpt;
+	view->directory_lists[pml4_index] = list;
+	view->directory_list_phys[pml4_index] = list_phys;
+
+	view->pml4[pml4_index].flags = this->pml4[pml4_index].flags;
+	view->pml4[pml4_index].page_frame_number = pdpt_phys / PAGE_SIZE;
+
+	return pdpt;
+}
+
+auto ept_t::find_view_directory(ept_view* view, u64 phys) -> ept_view_directory*
+{
+	auto const list = view->directory_lists[ADDRMASK_EPT_PML4_INDEX(phys)];
+
+	if (!list)
+		return nullptr;
+
+	return list->directories[ADDRMASK_EPT_PML3_INDEX(phys)];
+}
+
+// the view's own directory of the gigabyte around phys, copied on first use
+auto ept_t::view_directory(ept_view* view, u64 phys) -> ept_view_directory*
+{
+	if (auto const existing = this->find_view_directory(view, phys))
+		return existing;
+
+	auto const source = this->get_directory(phys);
+	auto const pdpt = source ? this->view_pdpt(view, phys) : nullptr;
+
+	if (!pdpt)
+		return nullptr;
+
+	u64 table_phys = 0;
+	u64 directory_phys = 0;
+	u64 leaf_list_phys = 0;
+
+	auto const table = static_cast<ept_pde_2mb*>(this->view_copy(view, source->table, &table_phys));
+	auto const directory = static_cast<ept_view_directory*>(this->view_copy(view, nullptr, &directory_phys));
+	auto const leaf_list = static_cast<ept_split_list*>(this->view_copy(view, nullptr, &leaf_list_phys));
+
+	if (!table || !directory || !leaf_list)
+	{
+		if (table)
+			this->view_free(view, table, table_phys);
+
+		if (directory)
+			this->view_free(view, directory, directory_phys);
+
+		if (leaf_list)
+			this->view_free(view, leaf_list, leaf_list_phys);
+
+		return nullptr;
+	}
+
+	directory->table = table;
+	directory->table_phys = table_phys;
+	directory->self_phys = directory_phys;
+	directory->source = source;
+	directory->leaf_list = leaf_list;
+	directory->leaf_list_phys = leaf_list_phys;
+
+	auto const pml4_index = ADDRMASK_EPT_PML4_INDEX(phys);
+	auto const pdpt_index = ADDRMASK_EPT_PML3_INDEX(phys);
+
+	view->directory_lists[pml4_index]->directories[pdpt_index] = directory;
+
+	pdpt[pdpt_index].flags = this->pdpt_tables[pml4_index][pdpt_index].flags;
+	pdpt[pdpt_index].page_frame_number = table_phys / PAGE_SIZE;
+
+	return directory;
+}
+
+// frees the private directory of the gigabyte around phys, the view's pdpt
+// points at the shared one again
+auto ept_t::drop_view_directory(ept_view* view, u64 phys) -> void
+{
+	auto const directory = this->find_view_directory(view, phys);
+
+	if (!directory)
+		return;
+
+	auto const base = phys & ~(1_gb - 1);
+
+	for (auto i = 0ull; i < EPT_PDE_ENTRY_COUNT; ++i)
+	{
+		this->drop_view_leaf(view, directory, base + i * 2_mb);
+	}
+
+	auto const pml4_index = ADDRMASK_EPT_PML4_INDEX(phys);
+	auto const pdpt_index = ADDRMASK_EPT_PML3_INDEX(phys);
+
+	view->directory_lists[pml4_index]->directories[pdpt_index] = nullptr;
+	view->pdpts[pml4_index][pdpt_index].flags = this->pdpt_tables[pml4_index][pdpt_index].flags;
+
+	auto const self_phys = directory->self_phys;
+
+	this->view_free(view, directory->leaf_list, directory->leaf_list_phys);
+	this->view_free(view, directory->table, directory->table_phys);
+	this->view_free(view, directory, self_phys);
+}
+
+// frees the private leaf table of the 2mb range around phys and points the
+// pde back at the shared one. hook ptes inside it are cleared, returns
+// whether there was a private table
+auto ept_t::drop_view_leaf(ept_view* view, ept_view_directory* directory, u64 phys) -> bool
+{
+	auto const pd_index = ADDRMASK_EPT_PML2_INDEX(phys);
+	auto const leaf = directory->leaf_list->splits[pd_index];
+	auto const pde = reinterpret_cast<ept_pde*>(&directory->table[pd_index]);
+
+	if (!leaf)
+	{
+		pde->flags = reinterpret_cast<ept_pde*>(&directory->source->table[pd_index])->flags;
+		return false;
+	}
+
+	auto const base = phys & ~(2_mb - 1);
+
+	for (auto i = 0ull; i < EPT_PTE_ENTRY_COUNT; ++i)
+	{
+		auto const hook = this->lookup_hook(base / PAGE_SIZE + i);
+
+		if (hook && view->hook_ptes[hook - this->hook_list] == &leaf[i])
+			view->hook_ptes[hook - this->hook_list] = nullptr;
+	}
+
+	this->view_free(view, leaf, pde->page_frame_number * PAGE_SIZE);
+
+	directory->leaf_list->splits[pd_index] = nullptr;
+	pde->flags = reinterpret_cast<ept_pde*>(&directory->source->table[pd_index])->flags;
+
+	return true;
+}
+
+// copies every table on the path to phys that the view still shares,
+// returns the view's own pte
+auto ept_t::privatize(ept_view* view, u64 phys) -> ept_pte*
+{
+	auto const shared_pte = this->get_pte(phys);
+
+	if (!shared_pte)
+		return nullptr;
+
+	auto const directory = this->view_directory(view, phys);
+
+	if (!directory)
+		return nullptr;
+
+	auto const pd_index = ADDRMASK_EPT_PML2_INDEX(phys);
+	auto leaf = directory->leaf_list->splits[pd_index];
+
+	if (!leaf)
+	{
+		u64 leaf_phys = 0;
+
+		leaf = static_cast<ept_pte*>(this->view_copy(view, PAGE_ALIGN(shared_pte), &leaf_phys));
+
+		if (!leaf)
+			return nullptr;
+
+		directory->leaf_list->splits[pd_index] = leaf;
+		reinterpret_cast<ept_pde*>(&directory->table[pd_index])->page_frame_number = leaf_phys / PAGE_SIZE;
+	}
+
+	return &leaf[ADDRMASK_EPT_PML1_INDEX(phys)];
+}
+
+// the pte a hook has in a view
+auto ept_t::hook_pte_flags(const ept_view* view, ept_view_index index, const ept_hook* hook) -> u64
+{
+	ept_pte pte;
+	pte.flags = (index == ept_view_execute) ? hook->exec_page.flags : hook->rw_page.flags;
+
+	// the guest's #ve handler switches views itself with vmfunc
+	if (view->deliver_ve)
+		pte.suppress_ve = 0;
+
+	return pte.flags;
+}
+
+// maps a live hook the way the view wants it
+auto ept_t::apply_hook(ept_view* view, ept_view_index index, u64 hook_index) -> bool
+{
+	auto const hook = &this->hook_list[hook_index];
+	auto const pte = this->privatize(view, reinterpret_cast<u64>(hook->physical_address));
+
+	if (!pte)
+		return false;
+
+	pte->flags = this->hook_pte_flags(view, index, hook);
+
+	view->hook_ptes[hook_index] = pte;
+
+	return true;
+}
+
+// brings the entry a change touched in line with the shared tables as they
+// are now, so replaying several changes of one entry ends up in one place
+auto ept_t::sync_change(ept_view* view, ept_view_index index, const ept_change& change) -> bool
+{
+	auto const phys = change.phys;
+
+	if (change.level == ept_change_pte)
+	{
+		if (change.hook_index != EPT_NO_HOOK)
+			view->hook_ptes[change.hook_index] = nullptr;
+
+		auto const hook = this->lookup_hook(phys / PAGE_SIZE);
+
+		if (hook && this->hook_live(hook - this->hook_list))
+			return this->apply_hook(view, index, hook - this->hook_list);
+
+		if (hook)
+			view->hook_ptes[hook - this->hook_list] = nullptr;
+
+		auto const directory = this->find_view_directory(view, phys);
+		auto const leaf = directory ? directory->leaf_list->splits[ADDRMASK_EPT_PML2_INDEX(phys)] : nullptr;
+		auto const shared_pte = this->get_pte(phys);
+
+		if (leaf && shared_pte)
+			leaf[ADDRMASK_EPT_PML1_INDEX(phys)].flags = shared_pte->flags;
+
+		return true;
+	}
+
+	if (change.level == ept_change_pde)
+	{
+		auto const directory = this->find_view_directory(view, phys);
+
+		// a shared directory shows the change already. a replaced one is
+		// handled by the pdpte change that replaced it
+		if (!directory || directory->source != this->get_directory(phys))
+			return true;
+
+		if (!this->drop_view_leaf(view, directory, phys))
+			return true;
+
+		// hooks in the range get their private ptes back on the new table
+		for (auto i = 0ull; i < EPT_PTE_ENTRY_COUNT; ++i)
+		{
+			auto const hook = this->lookup_hook(phys / PAGE_SIZE + i);
+
+			if (hook && this->hook_live(hook - this->hook_list) && !this->apply_hook(view, index, hook - this->hook_list))
+				return false;
+		}
+
+		return true;
+	}
+
+	auto const pml4_index = ADDRMASK_EPT_PML4_INDEX(phys);
+	auto const pdpt_index = ADDRMASK_EPT_PML3_INDEX(phys);
+
+	if (!view->pdpts[pml4_index])
+	{
+		view->pml4[pml4_index].flags = this->pml4[pml4_index].flags;
+
+		if (!this->replicate || !this->pdpt_tables[pml4_index])
+			return true;
+
+		if (!this->view_pdpt(view, phys))
+			return false;
+
+		for (auto j = 0ull; j < EPT_PDPTE_ENTRY_COUNT; ++j)
+		{
+			if (this->directory_lists[pml4_index]->directories[j] &&
+				!this->view_directory(view, (phys & ~((1ull << 39) - 1)) | (j << 30)))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	auto const directory = this->find_view_directory(view, phys);
+	auto const source = this->get_directory(phys);
+
+	if (directory && directory->source == source)
+		return true;
+
+	if (directory)
+		this->drop_view_directory(view, phys);
+
+	view->pdpts[pml4_index][pdpt_index].flags = this->pdpt_tables[pml4_index][pdpt_index].flags;
+
+	if (this->replicate && source && !this->view_directory(view, phys))
+		return false;
+
+	if (!directory)
+		return true;
+
+	// rare, the hooks of the whole gigabyte are looked for
+	for (auto i = 0ull; i < this->hook_watermark; ++i)
+	{
+		auto const hook_phys = reinterpret_cast<u64>(this->hook_list[i].physical_address);
+
+		if (!hook_phys || (hook_phys & ~(1_gb - 1)) != phys || !this->hook_live(i))
+			continue;
+
+		if (!this->apply_hook(view, index, i))
+			return false;
+	}
+
+	return true;
+}
+
+// counts exec <-> data alternations of a hook, returns whether its data
+// accesses are single-stepped. the state is shared by every vcpu and only
+// approximate, a lost update just delays the switch
+auto ept_t::track_flip(u64 hook_index) -> bool
+{
+	auto& state = this->hook_states[hook_index];
+	auto const now = __rdtsc();
+
+	if (now - state.last_flip > EPT_HOOK_THRASH_WINDOW)
+		state.thrash = 0;
+	else if (++state.thrash >= EPT_HOOK_THRASH_THRESHOLD)
+		state.single_step = true;
+
+	state.last_flip = now;
+	++state.flips;
+
+	return state.single_step;
+}
+
+auto ept_t::find_ept_hook(void* phys_addr)->ept_hook*
+{
+	return this->lookup_hook(reinterpret_cast<u64>(phys_addr) >> 12);
+}
+
+// callers hold ept_lock. fails when the shadow page can't be retired yet,
+// the removal has to be retried once the vcpus flushed
+auto ept_t::remove_hook_locked(u64 hook_index) -> bool
+{
+	auto hook = &this->hook_list[hook_index];
+
+	// the shadow page can only be reused once no vcpu can execute from it.
+	// one slot for it and one for the split table release_split may coalesce
+	if (this->retired_count + 2 > RETIRED_TABLES_MAX)
+		this->reclaim_retired_locked();
+
+	if (this->retired_count + 2 > RETIRED_TABLES_MAX)
+		return false;
+
+	hook->target_page->flags = hook->original_page.flags;
+	this->log_change(reinterpret_cast<u64>(hook->physical_address), ept_change_pte, static_cast<u16>(hook_index));
+
+	this->unindex_hook(reinterpret_cast<u64>(hook->physical_address) >> 12);
+	this->release_split(reinterpret_cast<u64>(hook->physical_address));
+
+	this->retired_tables[this->retired_count].pool = &this->shadow_pool;
+	this->retired_tables[this->retired_count].table = hook->fake_page;
+	this->retired_tables[this->retired_count].phys = hook->exec_page.page_frame_number * PAGE_SIZE;
+	this->retired_tables[this->retired_count].generation = static_cast<u64>(this->generation) + 1;
+	++this->retired_count;
+
+	hook->physical_address = 0;
+	hook->virtual_address = 0;
+	hook->fake_page = nullptr;
+
+	//auto vmroot_cr3 = __readcr3();
+
+	//__writecr3(ghv.system_cr3.flags);
+
+	//vmx::unlock_pages(hook->mdl);
+
+	//__writecr3(vmroot_cr3);
+
+	hook->mdl = 0;
+
+	this->hook_groups[this->hook_group_of[hook_index]].hook_count -= 1;
+	this->hook_group_of[hook_index] = 0;
+
+	this->free_hooks[this->free_hook_count++] = static_cast<u16>(hook_index);
+	this->hook_count -= 1;
+
+	return true;
+}
+
+// ept_remove_retry when the hook is there but the retired list is full,
+// it drains as the vcpus flush
+auto ept_t::remove_ept_hook(void* virt_addr) -> ept_remove_result
+{
+	this->ept_lock.lock();
+
+	for (auto i = 0ull; i < this->hook_watermark; ++i)
+	{
+		auto hook = &this->hook_list[i];
+
+		if (!hook->physical_address || hook->virtual_address != virt_addr)
+			continue;
+
+		if (!this->remove_hook_locked(i))
+		{
+			this->ept_lock.unlock();
+
+			return ept_remove_retry;
+		}
+
+		this->ept_lock.unlock();
+
+		invalidate();
+
+		return ept_remove_done;
+	}
+
+	this->ept_lock.unlock();
+
+	return ept_remove_not_found;
+}
+
+auto ept_t::hook_live(u64 hook_index) -> bool
+{
+	return this->hook_groups[this->hook_group_of[hook_index]].active;
+}
+
+// returns the id of the group called name, creating it (inactive) if it
+// doesn't exist yet. 0 when every group is taken
+auto ept_t::create_hook_group(u64 name) -> u64
+{
+	if (!name)
+		return 0;
+
+	auto group = 0ull;
+
+	this->ept_lock.lock();
+
+	for (auto i = 1ull; i < EPT_HOOK_GROUPS_MAX; ++i)
+	{
+		if (this->hook_groups[i].name == name)
+		{
+			group = i;
+			break;
+		}
+
+		if (!group && !this->hook_groups[i].name)
+			group = i;
+	}
+
+	if (group && !this->hook_groups[group].name)
+	{
+		this->hook_groups[group].name = name;
+		this->hook_groups[group].hook_count = 0;
+		this->hook_groups[group].active = false;
+	}
+
+	this->ept_lock.unlock();
+
+	return group;
+}
+
+// moves every hook of the group between its original and hooked pte, the
+// caller keeps the other vcpus parked so none of them sees half a group.
+// returns the number of hooks switched
+auto ept_t::set_hook_group(u64 group, bool active) -> u64
+{
+	if (!group || group >= EPT_HOOK_GROUPS_MAX || !this->hook_groups[group].name)
+		return 0;
+
+	auto switched = 0ull;
+
+	this->ept_lock.lock();
+
+	if (this->hook_groups[group].active != active)
+	{
+		this->hook_groups[group].active = active;
+
+		for (auto i = 0ull; i < this->hook_watermark; ++i)
+		{
+			auto const hook = &this->hook_list[i];
+
+			if (!hook->physical_address || this->hook_group_of[i] != group)
+				continue;
+
+			hook->target_page->flags = active ? hook->rw_page.flags : hook->original_page.flags;
+			this->log_change(reinterpret_cast<u64>(hook->physical_address), ept_change_pte, static_cast<u16>(i));
+
+			// start the thrash detection over, the old history is meaningless
+			memset(&this->hook_states[i], 0, sizeof(ept_hook_state));
+
+			++switched;
+		}
+	}
+
+	this->ept_lock.unlock();
+
+	if (switched)
+		this->invalidate();
+
+	return switched;
+}
+
+// removes every hook of the group and frees the name once it is empty.
+// returns the number of hooks removed, remaining is how many were left
+// behind because the retired list filled up and need another try
+auto ept_t::remove_hook_group(u64 group, u64& remaining) -> u64
+{
+	remaining = 0;
+
+	if (!group || group >= EPT_HOOK_GROUPS_MAX || !this->hook_groups[group].name)
+		return 0;
+
+	auto removed = 0ull;
+
+	this->ept_lock.lock();
+
+	for (auto i = 0ull; i < this->hook_watermark; ++i)
+	{
+		if (!this->hook_list[i].physical_address || this->hook_group_of[i] != group)
+			continue;
+
+		if (!this->remove_hook_locked(i))
+			break;
+
+		++removed;
+	}
+
+	remaining = this->hook_groups[group].hook_count;
+
+	if (!remaining)
+	{
+		this->hook_groups[group].name = 0;
+		this->hook_groups[group].active = false;
+	}
+
+	this->ept_lock.unlock();
+
+	if (removed)
+		this->invalidate();
+
+	return removed;
+}
+
+// hints are checked before anything is touched, the patch has to stay
+// inside the hooked page. callers run on the system cr3
+auto ept_t::validate_hint(const ept_hint* hint) -> ept_hook_status
+{
+	if (!hint || !PAGE_ALIGN(hint->physical_addr))
+		return ept_hook_invalid_hint;
+
+	auto const page_offset = hint->virtual_addr & (PAGE_SIZE - 1);
+
+	if (hint->patch_size && (!hint->patch || hint->patch_size > PAGE_SIZE - page_offset))
+		return ept_hook_invalid_hint;
+
+	return ept_hook_installed;
+}
+
+// callers hold ept_lock with the system cr3 loaded. a new hook consumes
+// shadow_page (which is then cleared) and joins group, patching an existing
+// one doesn't and leaves it in its group
+auto ept_t::install_hook_locked(ept_hint* hint, u8 group, u8*& shadow_page, u64 shadow_phys) -> ept_hook_status
+{
+	auto physical_page = PAGE_ALIGN(hint->physical_addr);
+
+	ept_hook* hook_entry = find_ept_hook(physical_page);
+
+	if (hook_entry)
+	{
+		// a dormant hook sits on its original frame on purpose
+		if (hook_entry->target_page->flags == hook_entry->original_page.flags &&
+			this->hook_live(hook_entry - this->hook_list))
+		{
+			memcpy(&hook_entry->fake_page[0], &hint->page_copy[0], PAGE_SIZE);
+
+			hook_entry->target_page->flags = hook_entry->rw_page.flags;
+			this->log_change(reinterpret_cast<u64>(physical_page), ept_change_pte, static_cast<u16>(hook_entry - this->hook_list));
+		}
+
+		hook_entry->mdl = hint->mdl;
+
+		auto page_offset = (uintptr_t)hint->virtual_addr & (PAGE_SIZE - 1);
+		memcpy(hook_entry->fake_page + page_offset, hint->patch, hint->patch_size);
+
+		return ept_hook_installed;
+	}
+
+	if (!this->free_hook_count)
+		return ept_hook_no_slot;
+
+	if (!shadow_page)
+		return ept_hook_no_memory;
+
+	auto const target_page = this->split_large_page((u64)physical_page)
+		? this->get_pte((u64)physical_page) : nullptr;
+
+	if (!target_page)
+		return ept_hook_no_table;
+
+	auto const fake_page = shadow_page;
+	auto const fake_page_phys = shadow_phys;
+
+	shadow_page = nullptr;
+
+	auto const hook_index = this->free_hooks[--this->free_hook_count];
+
+	if (hook_index >= this->hook_watermark)
+		this->hook_watermark = hook_index + 1ull;
+
+	this->hook_count += 1;
+
+	hook_entry = &this->hook_list[hook_index];
+
+	memset(&this->hook_states[hook_index], 0, sizeof(ept_hook_state));
+
+	this->hook_group_of[hook_index] = group;
+	this->hook_groups[group].hook_count += 1;
 
 	hook_entry->physical_address = physical_page;
 	hook_entry->virtual_address = (void*)hint->virtual_addr;
 	hook_entry->mdl = hint->mdl;
 
-	hook_entry->target_page = this->get_pte((u64)physical_page);
-
-	if (!hook_entry->target_page)
-		return false;
+	hook_entry->target_page = target_page;
+	hook_entry->fake_page = fake_page;
 
 	memcpy(&hook_entry->fake_page[0], &hint->page_copy[0], PAGE_SIZE);
 
@@ -273,17 +2146,143 @@ auto ept_t::install_page_hook(ept_hint* hint) -> bool
 	hook_entry->rw_page.execute_access = 0;
 
 	hook_entry->exec_page.flags = 0;
+	hook_entry->exec_page.suppress_ve = 1;
 	hook_entry->exec_page.read_access = 0;
 	hook_entry->exec_page.write_access = 0;
 	hook_entry->exec_page.execute_access = 1;
-	hook_entry->exec_page.page_frame_number = MmGetPhysicalAddress(&hook_entry->fake_page).QuadPart / PAGE_SIZE;
-
-	hook_entry->target_page->flags = hook_entry->rw_page.flags;
+	hook_entry->exec_page.page_frame_number = fake_page_phys / PAGE_SIZE;
 
 	auto page_offset = (uintptr_t)hint->virtual_addr & (PAGE_SIZE - 1);
 	memcpy(hook_entry->fake_page + page_offset, hint->patch, hint->patch_size);
 
+	// publish only once the hook is fully built
+	this->index_hook(reinterpret_cast<u64>(physical_page) >> 12, hook_index);
+	this->reference_split(reinterpret_cast<u64>(physical_page));
+
+	if (this->hook_groups[group].active)
+		hook_entry->target_page->flags = hook_entry->rw_page.flags;
+
+	this->log_change(reinterpret_cast<u64>(physical_page), ept_change_pte, hook_index);
+
+	return ept_hook_installed;
+}
+
+auto ept_t::install_page_hook(ept_hint* hint) -> bool
+{
+	auto vmroot_cr3 = __readcr3();
+
+	__writecr3(ghv.system_cr3.flags);
+
+	if (this->validate_hint(hint) != ept_hook_installed)
+	{
+		__writecr3(vmroot_cr3);
+		return false;
+	}
+
+	this->ept_lock.lock();
+
+	u64 shadow_phys = 0;
+	auto shadow_page = this->find_ept_hook(PAGE_ALIGN(hint->physical_addr))
+		? nullptr : static_cast<u8*>(this->shadow_pool.allocate(&shadow_phys));
+
+	auto const status = this->install_hook_locked(hint, 0, shadow_page, shadow_phys);
+
+	if (shadow_page)
+		this->shadow_pool.free(shadow_page, shadow_phys);
+
+	this->ept_lock.unlock();
 	__writecr3(vmroot_cr3);
 
-	return true;
-}
\ No newline at end of file
+	return status == ept_hook_installed;
+}
+
+// installs up to EPT_HOOK_BATCH_MAX hooks under one lock. every hint is
+// validated first, then the shadow pages of all new hooks are taken in one
+// pass. new hooks join group (0 for none), an inactive group leaves them
+// dormant. statuses gets one ept_hook_status per hint, the caller
+// invalidates once for the whole batch. returns the number of hooks installed
+auto ept_t::install_page_hooks(ept_hint** hints, u64 count, u8* statuses, u64 group) -> u64
+{
+	if (!hints || !statuses || !count || count > EPT_HOOK_BATCH_MAX)
+		return 0;
+
+	auto vmroot_cr3 = __readcr3();
+
+	__writecr3(ghv.system_cr3.flags);
+
+	this->ept_lock.lock();
+
+	auto const valid_group = group < EPT_HOOK_GROUPS_MAX && (!group || this->hook_groups[group].name);
+
+	for (auto i = 0ull; i < count; ++i)
+	{
+		statuses[i] = valid_group ? this->validate_hint(hints[i]) : ept_hook_invalid_group;
+	}
+
+	auto const shadow_pages = this->batch_shadow_pages;
+	auto const shadow_phys = this->batch_shadow_phys;
+
+	for (auto i = 0ull; i < count; ++i)
+	{
+		shadow_pages[i] = nullptr;
+		shadow_phys[i] = 0;
+
+		if (statuses[i] != ept_hook_installed)
+			continue;
+
+		auto const page = PAGE_ALIGN(hints[i]->physical_addr);
+
+		if (this->find_ept_hook(page))
+			continue;
+
+		// only the first hint of a page in the batch creates the hook
+		auto first = true;
+
+		for (auto j = 0ull; j < i && first; ++j)
+		{
+			first = statuses[j] != ept_hook_installed || PAGE_ALIGN(hints[j]->physical_addr) != page;
+		}
+
+		if (first)
+			shadow_pages[i] = static_cast<u8*>(this->shadow_pool.allocate(&shadow_phys[i]));
+	}
+
+	auto installed = 0ull;
+
+	for (auto i = 0ull; i < count; ++i)
+	{
+		if (statuses[i] == ept_hook_installed)
+			statuses[i] = this->install_hook_locked(hints[i], static_cast<u8>(group), shadow_pages[i], shadow_phys[i]);
+
+		if (statuses[i] == ept_hook_installed)
+			++installed;
+
+		if (!shadow_pages[i])
+			continue;
+
+		// the hook wasn't created, the next hint for the same page gets a
+		// chance with this shadow page instead of going without
+		auto const page = PAGE_ALIGN(hints[i]->physical_addr);
+		auto handed_on = false;
+
+		for (auto j = i + 1; j < count && !handed_on; ++j)
+		{
+			if (statuses[j] != ept_hook_installed || PAGE_ALIGN(hints[j]->physical_addr) != page)
+				continue;
+
+			shadow_pages[j] = shadow_pages[i];
+			shadow_phys[j] = shadow_phys[i];
+			handed_on = true;
+		}
+
+		if (!handed_on)
+			this->shadow_pool.free(shadow_pages[i], shadow_phys[i]);
+
+		shadow_pages[i] = nullptr;
+	}
+
+	this->ept_lock.unlock();
+	__writecr3(vmroot_cr3);
+
+	return installed;
+}
@@ -1,15 +1,110 @@
 #pragma once
 
 #include "types.h"
+#include "spinlock.h"
+#include "pool.h"
+#include "mtrr.h"
 
-#define FREE_PAGES_SIZE 6000
 #define MAX_EPT_HOOKS   6000
 
+// hints a single batched install may carry
+#define EPT_HOOK_BATCH_MAX 256
+
+// fixed identity map start() falls back to without a physical memory map
+#define EPT_FALLBACK_MAP_SIZE 512_gb
+
+// named hook groups, group 0 holds the ungrouped hooks and is always live
+#define EPT_HOOK_GROUPS_MAX 64
+
+// pools are grown by a PASSIVE_LEVEL worker whenever they drop below the
+// low-water mark, vmx-root only ever takes pages that already exist
+#define TABLE_POOL_CHUNK      64
+#define TABLE_POOL_LOW_WATER  16
+#define SHADOW_POOL_CHUNK     64
+#define SHADOW_POOL_LOW_WATER 16
+
+// split tables released by coalescing and shadow pages of removed hooks
+// wait here until every vcpu flushed
+#define RETIRED_TABLES_MAX 64
+
+// numa nodes with a pool of their own for view tables, views of vcpus on
+// higher nodes share table_pool. create_view reserves what a replicated view
+// needs up front, the chunks only cover paths to new hooks
+#define EPT_MAX_NODES 64
+#define VIEW_POOL_CHUNK     256
+#define VIEW_POOL_LOW_WATER 64
+
+// pages every view reserves on top of replicated tables for the paths to
+// its first hooks
+#define EPT_VIEW_HOOK_RESERVE 64
+
+// shared table changes views replay on their next flush instead of being
+// rebuilt, a view that fell further behind is rebuilt in full
+#define EPT_CHANGE_LOG_SIZE 4096
+#define EPT_CHANGE_LOG_MASK (EPT_CHANGE_LOG_SIZE - 1)
+
+// hook index of a change that isn't tied to a hook slot
+#define EPT_NO_HOOK 0xFFFF
+
+// on multi-node machines every view also carries copies of all pdpts and
+// directories, so upper level walks stay on the vcpu's node. leaf tables
+// remain shared
+#define EPT_REPLICATE_ON_NUMA 1
+
+// a hook alternating between its exec and data views more than
+// EPT_HOOK_THRASH_THRESHOLD times in a row, each within EPT_HOOK_THRASH_WINDOW
+// tsc ticks of the last, has its data accesses single-stepped instead. only
+// vcpus on their private views step, the others keep flipping the pte
+#define EPT_HOOK_THRASH_THRESHOLD 64
+#define EPT_HOOK_THRASH_WINDOW    100000
+
+// open-addressing index of hooks keyed by guest pfn, must be a power of two
+// and comfortably larger than MAX_EPT_HOOKS to keep probe sequences short
+#define EPT_HOOK_INDEX_BITS 14
+#define EPT_HOOK_INDEX_SIZE (1ull << EPT_HOOK_INDEX_BITS)
+#define EPT_HOOK_INDEX_MASK (EPT_HOOK_INDEX_SIZE - 1)
+
 typedef struct ept_split
 {
 	alignas(PAGE_SIZE) ept_pte pte[EPT_PTE_ENTRY_COUNT]{};
 };
 
+// virtual address of the split table behind every pde, nullptr while the
+// pde maps a 2mb page or the shared hidden table
+typedef struct ept_split_list
+{
+	ept_pte* splits[EPT_PDE_ENTRY_COUNT];
+};
+
+static_assert(sizeof(ept_split_list) <= PAGE_SIZE);
+
+// software side of a page directory, taken from table_pool together with
+// the directory itself and its split list
+typedef struct ept_directory
+{
+	ept_pde_2mb* table;
+	u64 table_phys;
+	u64 self_phys;
+
+	ept_split_list* split_list;
+	u64 split_list_phys;
+
+	// number of modified (non identity) ptes per split pde, the split is
+	// folded back into a large page when it drops to zero
+	u16 split_refs[EPT_PDE_ENTRY_COUNT];
+};
+
+static_assert(sizeof(ept_directory) <= PAGE_SIZE);
+
+// software side of a pdpt, one directory per pdpte. nullptr while the
+// pdpte maps a 1gb page or isn't populated yet
+typedef struct ept_directory_list
+{
+	ept_directory* directories[EPT_PDPTE_ENTRY_COUNT];
+};
+
+static_assert(sizeof(ept_directory_list) <= PAGE_SIZE);
+
 typedef struct ept_hint
 {
 	alignas(PAGE_SIZE) u8 page_copy[PAGE_SIZE];
@@ -20,13 +115,14 @@ typedef struct ept_hint
 	MDL* mdl;
 };
 
-typedef struct ept_hook
+// hook metadata only, one cache line per hook. the shadow (fake) page is
+// taken from ept_t::shadow_pool when the hook is installed
+typedef struct alignas(64) ept_hook
 {
-	alignas(PAGE_SIZE) u8 fake_page[PAGE_SIZE];
-
 	void* physical_address;
 	void* virtual_address;
 	MDL* mdl;
+	u8* fake_page;
 
 	ept_pte* target_page;
 	ept_pte original_page;
@@ -34,36 +130,389 @@ typedef struct ept_hook
 	ept_pte exec_page;
 };
 
+static_assert(sizeof(ept_hook) == 64);
+
+// result of populating the gigabyte around an address, only a mapped one
+// needs an invalidate()
+enum ept_populate_result : u8
+{
+	ept_populate_failed,
+	ept_populate_present,
+	ept_populate_mapped
+};
+
+// per-hint result of a hook install
+enum ept_hook_status : u8
+{
+	ept_hook_installed,
+	ept_hook_invalid_hint,
+	ept_hook_no_slot,
+	ept_hook_no_table,
+	ept_hook_no_memory,
+	ept_hook_invalid_group
+};
+
+// result of removing a hook, retry means the retired list is full until the
+// vcpus flush past it
+enum ept_remove_result : u8
+{
+	ept_remove_not_found,
+	ept_remove_done,
+	ept_remove_retry
+};
+
+// hooks of an inactive group are installed (shadow page, split, index) but
+// their pte stays on the original frame until the group is switched on
+typedef struct ept_hook_group
+{
+	u64 name;
+	u32 hook_count;
+	bool active;
+};
+
+// kept apart from ept_hook, written on every view flip
+typedef struct ept_hook_state
+{
+	u64 last_flip;
+	u64 flips;
+	u32 thrash;
+	bool single_step;
+};
+
+// layout handed out by the ept stats hypercall. fields are only ever
+// appended, callers check version and size before reading the tail
+#define EPT_STATS_VERSION 2
+
+typedef struct ept_pool_stats
+{
+	u64 total_pages;
+	u64 free_pages;
+	u64 peak_used_pages;
+	u64 failed_allocations;
+	u64 chunk_count;
+};
+
+typedef struct ept_stats
+{
+	u32 version;
+	u32 size;
+
+	// records written to the optional dump buffers
+	u64 hooks_dumped;
+	u64 splits_dumped;
+
+	u64 generation;
+	u64 max_phys_addr;
+	u64 node_count;
+
+	u64 split_count;
+	u64 coalesce_count;
+	u64 retired_count;
+
+	// 4kb pages mapped to the dummy page and 2mb ranges on the hidden table
+	u64 hidden_pages;
+	u64 hidden_large_pages;
+
+	// holes are free slots below the watermark that build_view still scans
+	u64 hook_count;
+	u64 hook_watermark;
+	u64 hook_holes;
+	u64 free_hook_count;
+	u64 hook_groups;
+	u64 active_hook_groups;
+
+	// violations that exited to the hypervisor, #ve deliveries aren't seen
+	u64 hook_violations;
+	u64 single_stepped_hooks;
+
+	ept_pool_stats table_pool;
+	ept_pool_stats shadow_pool;
+	ept_pool_stats view_pools;
+
+	// version 2. view syncs replay the change log, full builds start over.
+	// a failed sync leaves its vcpu on the shared tables until the next one
+	u64 view_full_builds;
+	u64 view_syncs;
+	u64 view_changes_replayed;
+	u64 view_failures;
+	u64 vcpus_on_shared_tables;
+	u64 view_reserve_pages;
+};
+
+// one per live hook, violations counts since install or the last group switch
+typedef struct ept_hook_record
+{
+	u64 physical_address;
+	u64 virtual_address;
+	u64 violations;
+	u16 index;
+	u8 group;
+	bool active;
+	bool single_step;
+};
+
+// one per split 2mb range, refs are the ptes keeping it from coalescing
+typedef struct ept_split_record
+{
+	u64 base;
+	u16 refs;
+};
+
+// packed so an entry is published/cleared with a single store, pfn 0 marks
+// an empty bucket (physical page 0 is never hooked)
+typedef union ept_hook_bucket
+{
+	struct
+	{
+		u64 pfn : 48;
+		u64 hook_index : 16;
+	};
+
+	u64 flags;
+};
+
+// views every vcpu keeps, also their index in its eptp list
+enum ept_view_index : u32
+{
+	ept_view_read,		// hooked pages map the original frame, read/write only
+	ept_view_execute,	// hooked pages map the shadow frame, execute only
+	ept_view_count
+};
+
+struct vcpu_t;
+
+// shared table a change touched, views resync the entry at that level
+enum ept_change_level : u8
+{
+	ept_change_pte,
+	ept_change_pde,
+	ept_change_pdpte
+};
+
+typedef struct ept_change
+{
+	u64 phys;
+	u16 hook_index;
+	ept_change_level level;
+};
+
+// software side of a private page directory in a view, taken from the view's
+// pool together with the directory and its leaf list. source is the shared
+// directory it was copied from
+typedef struct ept_view_directory
+{
+	ept_pde_2mb* table;
+	u64 table_phys;
+	u64 self_phys;
+
+	ept_directory* source;
+
+	// private leaf table behind every pde, nullptr while the view shares it
+	ept_split_list* leaf_list;
+	u64 leaf_list_phys;
+};
+
+static_assert(sizeof(ept_view_directory) <= PAGE_SIZE);
+
+typedef struct ept_view_directory_list
+{
+	ept_view_directory* directories[EPT_PDPTE_ENTRY_COUNT];
+};
+
+static_assert(sizeof(ept_view_directory_list) <= PAGE_SIZE);
+
+// per-vcpu hierarchy. everything is shared with ept_t except the paths down
+// to hooked pages, those are copied so every view can map them its own way.
+// private tables are found by slot, the same way ept_t finds its own
+typedef struct ept_view
+{
+	alignas(PAGE_SIZE) ept_pml4e pml4[EPT_PML4E_ENTRY_COUNT];
+	u64 pml4_phys;
+
+	// private tables come from the pool of the owning vcpu's node
+	page_pool* pool;
+
+	// private pdpt behind every pml4e (its physical address is in the pml4e)
+	// and its directory list, nullptr while the view shares the pdpt
+	ept_pdpte* pdpts[EPT_PML4E_ENTRY_COUNT];
+	ept_view_directory_list* directory_lists[EPT_PML4E_ENTRY_COUNT];
+	u64 directory_list_phys[EPT_PML4E_ENTRY_COUNT];
+
+	u64 page_count;
+
+	// position in the change log the view is in sync with. built is false
+	// until a full build succeeds and again after a failed sync
+	u64 synced_changes;
+	bool built;
+	bool deliver_ve;
+
+	// private pte of every live hook slot
+	ept_pte* hook_ptes[MAX_EPT_HOOKS];
+};
+
 class ept_t
 {
 public:
-	auto start() -> void;
+	auto start() -> bool;
 	auto get_ept_pointer()->ept_pointer;
+	auto get_ept_pointer(ept_view* view)->ept_pointer;
 
 	auto invalidate() -> void;
+	auto flush(vcpu_t* cpu) -> void;
+	auto reclaim_retired() -> void;
+	auto reclaim_retired_locked() -> void;
 
+	auto get_pdpte(u64 phys)->ept_pdpte*;
+	auto get_directory(u64 phys)->ept_directory*;
 	auto get_pde_2mb(u64 phys)->ept_pde_2mb*;
 	auto get_pte(u64 phys)->ept_pte*;
 
+	auto populate(u64 phys)->ept_populate_result;
+	auto populate_range(u64 base, u64 end, u64& populated, u64& large_pages) -> bool;
+	auto create_directory(u64 phys, ept_pde_2mb pml2_template)->ept_directory*;
+	auto link_directory(u64 phys, ept_directory* directory) -> void;
+	auto split_mixed_page(u64 phys) -> bool;
+
+	auto update_memory_types() -> void;
+	auto retype_range(u64 base, u64 end) -> bool;
+	auto retype_large_page(u64 phys) -> bool;
+
+	auto split_1gb_page(u64 phys) -> bool;
 	auto split_large_page(u64 phys) -> bool;
 
+	auto reference_split(u64 phys) -> void;
+	auto release_split(u64 phys) -> void;
+	auto coalesce_large_page(u64 phys) -> bool;
+
+	auto refill_pools() -> void;
+
+	auto is_hidden(const ept_pde_2mb* pde_2mb) -> bool;
+	auto hide_page(u64 phys) -> bool;
+	auto hide_large_page(u64 phys) -> bool;
+	auto hide_range(u64 phys, u64 size)->u64;
+
+	auto collect_stats(ept_stats& stats) -> void;
+	auto dump_hooks(ept_hook_record* records, u64 capacity)->u64;
+	auto dump_splits(ept_split_record* records, u64 capacity)->u64;
+
+	auto log_change(u64 phys, ept_change_level level, u16 hook_index = EPT_NO_HOOK) -> void;
+
+	auto create_view(u32 node) -> ept_view*;
+	auto sync_view(ept_view* view, ept_view_index index, bool deliver_ve) -> bool;
+	auto build_view(ept_view* view, ept_view_index index, bool deliver_ve) -> bool;
+	auto release_view(ept_view* view) -> void;
+	auto view_copy(ept_view* view, const void* table, u64* phys) -> void*;
+	auto view_free(ept_view* view, void* page, u64 phys) -> void;
+	auto view_pdpt(ept_view* view, u64 phys)->ept_pdpte*;
+	auto view_directory(ept_view* view, u64 phys)->ept_view_directory*;
+	auto find_view_directory(ept_view* view, u64 phys)->ept_view_directory*;
+	auto drop_view_directory(ept_view* view, u64 phys) -> void;
+	auto drop_view_leaf(ept_view* view, ept_view_directory* directory, u64 phys) -> bool;
+	auto privatize(ept_view* view, u64 phys)->ept_pte*;
+	auto hook_pte_flags(const ept_view* view, ept_view_index index, const ept_hook* hook)->u64;
+	auto apply_hook(ept_view* view, ept_view_index index, u64 hook_index) -> bool;
+	auto sync_change(ept_view* view, ept_view_index index, const ept_change& change) -> bool;
+
+	auto track_flip(u64 hook_index) -> bool;
+
 	auto find_ept_hook(void* phys_addr)->ept_hook*;
-	auto remove_ept_hook(void* virt_addr) -> bool;
+	auto remove_ept_hook(void* virt_addr)->ept_remove_result;
 
+	auto validate_hint(const ept_hint* hint)->ept_hook_status;
+	auto install_hook_locked(ept_hint* hint, u8 group, u8*& shadow_page, u64 shadow_phys)->ept_hook_status;
 	auto install_page_hook(ept_hint* hint) -> bool;
+	auto install_page_hooks(ept_hint** hints, u64 count, u8* statuses, u64 group)->u64;
+	auto remove_hook_locked(u64 hook_index) -> bool;
+
+	auto create_hook_group(u64 name)->u64;
+	auto set_hook_group(u64 group, bool active)->u64;
+	auto remove_hook_group(u64 group, u64& remaining)->u64;
+	auto hook_live(u64 hook_index) -> bool;
+
+	auto index_hook(u64 pfn, u16 hook_index) -> void;
+	auto unindex_hook(u64 pfn) -> void;
+	auto lookup_hook(u64 pfn) -> ept_hook*;
+
+	page_pool table_pool;
+	page_pool shadow_pool;
+
+	page_pool view_pools[EPT_MAX_NODES];
+	u32 node_count;
+	bool replicate;
+	u64 split_count;
+	u64 coalesce_count;
+
+	struct
+	{
+		page_pool* pool;
+		void* table;
+		u64 phys;
+		u64 generation;
+	} retired_tables[RETIRED_TABLES_MAX];
+	u64 retired_count;
+
+	// shared table changes since start, under ept_lock. change_count only
+	// grows, entries wrap around the log
+	ept_change change_log[EPT_CHANGE_LOG_SIZE];
+	u64 change_count;
+
+	// pages create_view reserves per view, sized from the directories at start
+	u64 view_reserve_pages;
+
+	u64 view_full_builds;
+	u64 view_syncs;
+	u64 view_changes_replayed;
+	u64 view_failures;
+
+	// bumped by every change that needs a flush, vcpus compare it against
+	// the generation they last flushed at before each vm-entry
+	volatile long long generation;
 
 	ept_hook* hook_list;
 	u64 hook_count;
+	u64 hook_watermark;
+
+	// serializes every mutation of the paging structures and hooks
+	spinlock ept_lock;
+	seqlock hook_seq;
+
+	u64 free_hook_count;
+	u16 free_hooks[MAX_EPT_HOOKS];
+
+	ept_hook_state hook_states[MAX_EPT_HOOKS];
+
+	ept_hook_group hook_groups[EPT_HOOK_GROUPS_MAX];
+	u8 hook_group_of[MAX_EPT_HOOKS];
+
+	ept_hook_bucket hook_index[EPT_HOOK_INDEX_SIZE];
+
+	// shadow pages taken for a batched install, one per hint. under
+	// ept_lock, too large for the host stack
+	u8* batch_shadow_pages[EPT_HOOK_BATCH_MAX];
+	u64 batch_shadow_phys[EPT_HOOK_BATCH_MAX];
 
 	u64 plm4_phys;
+	u64 max_phys_addr;
+	bool large_pages_1gb;
+
+	// effective memory types, kept for gigabytes populated lazily from vmx-root.
+	// points into mtrr_maps, an mtrr write builds the other one and flips it
+	mtrr::mtrr_map* mtrr_data;
+	mtrr::mtrr_map mtrr_maps[2];
 
 	u64 dummy_page_pfn;
-	size_t used_free_pages;
+	u64 hidden_table_pfn;
 
 	alignas(PAGE_SIZE) ept_pml4e pml4[EPT_PML4E_ENTRY_COUNT];
-	alignas(PAGE_SIZE) ept_pdpte pdpt[EPT_PDPTE_ENTRY_COUNT];
-	alignas(PAGE_SIZE) ept_pde_2mb pde[EPT_PDPTE_ENTRY_COUNT][EPT_PDE_ENTRY_COUNT];
 
-	alignas(PAGE_SIZE) uint8_t free_pages[FREE_PAGES_SIZE][PAGE_SIZE];
+	// pdpt behind every pml4e and its directory list, both nullptr until
+	// something in that 512gb is populated. only ever grow
+	ept_pdpte* pdpt_tables[EPT_PML4E_ENTRY_COUNT];
+	ept_directory_list* directory_lists[EPT_PML4E_ENTRY_COUNT];
+
 	alignas(PAGE_SIZE) uint8_t dummy_page[PAGE_SIZE];
+
+	// leaf table mapping every entry to the dummy page, shared by all the
+	// pdes of fully hidden 2mb ranges. never written after start()
+	alignas(PAGE_SIZE) ept_pte hidden_table[EPT_PTE_ENTRY_COUNT];
 };
\ No newline at end of file
@@ -3,6 +3,17 @@
 
 namespace hv
 {
+    // parts of guest_registers the exit stub saved on top of the gprs and
+    // xmm0-xmm5 (volatile, the c++ side may clobber them). whatever wasn't
+    // saved is still live in the registers themselves
+    enum guest_state : u8
+    {
+        guest_state_xmm = 1 << 0,   // xmm6-xmm15
+        guest_state_cr  = 1 << 1,   // cr2, cr8
+        guest_state_dr  = 1 << 2,   // dr0-dr3, dr6
+        guest_state_all = guest_state_xmm | guest_state_cr | guest_state_dr
+    };
+
     struct alignas(16) guest_registers
     {
         union {
@@ -34,7 +45,8 @@ namespace hv
                     u8  bl;
                 };
 
-                u64 _padding;
+                // guest_state bits, kept in the rsp slot (rsp lives in the vmcs)
+                u64 saved;
 
                 union {
                     u64 rbp;
@@ -68,6 +68,10 @@ namespace handlers
 			return;
 		}
 
+		// keep the ept memory types in line with the new mtrr layout
+		if (mtrr::is_mtrr_msr(static_cast<u32>(msr)))
+			ghv.ept->update_memory_types();
+
 		cpu->hide_vm_exit_overhead = true;
 		skip_instruction();
 		return;
@@ -180,6 +184,14 @@ namespace handlers
 			case hypercalls::hypercall_remove_ept_hook:       hypercalls::remove_ept_hook(cpu);      return;
 			case hypercalls::hypercall_current_dirbase:       hypercalls::current_dirbase(cpu);      return;
 			case hypercalls::hypercall_copy_virtual_memory:   hypercalls::copy_memory(cpu);          return;
+			case hypercalls::hypercall_enable_ve:             hypercalls::enable_ve(cpu);            return;
+			case hypercalls::hypercall_install_ept_hooks:     hypercalls::install_ept_hooks(cpu);    return;
+			case hypercalls::hypercall_create_hook_group:     hypercalls::create_hook_group(cpu);    return;
+			case hypercalls::hypercall_set_hook_group:        hypercalls::set_hook_group(cpu);       return;
+			case hypercalls::hypercall_remove_hook_group:     hypercalls::remove_hook_group(cpu);    return;
+			case hypercalls::hypercall_hide_physical_range:   hypercalls::hide_physical_range(cpu);  return;
+			case hypercalls::hypercall_ept_stats:             hypercalls::get_ept_stats(cpu);        return;
+			case hypercalls::hypercall_exit_stats:            hypercalls::get_exit_stats(cpu);       return;
 		}
 
 		inject_hw_exception(invalid_opcode);
@@ -232,12 +244,12 @@ namespace handlers
 			return;
 		}
 
-		vm_write(VMCS_CTRL_CR0_READ_SHADOW, new_cr0.flags);
+		cpu->vmcs_cache.write<VMCS_CTRL_CR0_READ_SHADOW>(new_cr0.flags);
 
 		new_cr0.flags |= cpu->cached.vmx_cr0_fixed0;
 		new_cr0.flags &= cpu->cached.vmx_cr0_fixed1;
 
-		vm_write(VMCS_GUEST_CR0, new_cr0.flags);
+		cpu->vmcs_cache.write<VMCS_GUEST_CR0>(new_cr0.flags);
 
 		cpu->hide_vm_exit_overhead = true;
 		skip_instruction();
@@ -276,7 +288,7 @@ namespace handlers
 			invvpid(invvpid_single_context_retaining_globals, desc);
 		}
 
-		vm_write(VMCS_GUEST_CR3, new_cr3.flags);
+		cpu->vmcs_cache.write<VMCS_GUEST_CR3>(new_cr3.flags);
 
 		cpu->hide_vm_exit_overhead = true;
 		skip_instruction();
@@ -288,7 +300,7 @@ namespace handlers
 		new_cr4.flags = read_guest_gpr(cpu->ctx, gpr);
 
 		cr3 curr_cr3;
-		curr_cr3.flags = vm_read(VMCS_GUEST_CR3);
+		curr_cr3.flags = cpu->vmcs_cache.read<VMCS_GUEST_CR3>();
 
 		auto const curr_cr0 = read_effective_guest_cr0();
 		auto const curr_cr4 = read_effective_guest_cr4();
@@ -341,12 +353,12 @@ namespace handlers
 			invvpid(invvpid_single_context, desc);
 		}
 
-		vm_write(VMCS_CTRL_CR4_READ_SHADOW, new_cr4.flags);
+		cpu->vmcs_cache.write<VMCS_CTRL_CR4_READ_SHADOW>(new_cr4.flags);
 
 		new_cr4.flags |= cpu->cached.vmx_cr4_fixed0;
 		new_cr4.flags &= cpu->cached.vmx_cr4_fixed1;
 
-		vm_write(VMCS_GUEST_CR4, new_cr4.flags);
+		cpu->vmcs_cache.write<VMCS_GUEST_CR4>(new_cr4.flags);
 
 		cpu->hide_vm_exit_overhead = true;
 		skip_instruction();
@@ -354,7 +366,7 @@ namespace handlers
 
 	auto mov_from_cr3(vcpu_t* cpu, u64 gpr) -> void
 	{
-		write_guest_gpr(cpu->ctx, gpr, vm_read(VMCS_GUEST_CR3));
+		write_guest_gpr(cpu->ctx, gpr, cpu->vmcs_cache.read<VMCS_GUEST_CR3>());
 
 		cpu->hide_vm_exit_overhead = true;
 		skip_instruction();
@@ -362,10 +374,10 @@ namespace handlers
 
 	auto clts(vcpu_t* cpu) -> void
 	{
-		vm_write(VMCS_CTRL_CR0_READ_SHADOW,
-			vm_read(VMCS_CTRL_CR0_READ_SHADOW) & ~CR0_TASK_SWITCHED_FLAG);
+		cpu->vmcs_cache.write<VMCS_CTRL_CR0_READ_SHADOW>(
+			cpu->vmcs_cache.read<VMCS_CTRL_CR0_READ_SHADOW>() & ~CR0_TASK_SWITCHED_FLAG);
 
-		vm_write(VMCS_GUEST_CR0, vm_read(VMCS_GUEST_CR0) & ~CR0_TASK_SWITCHED_FLAG);
+		cpu->vmcs_cache.write<VMCS_GUEST_CR0>(cpu->vmcs_cache.read<VMCS_GUEST_CR0>() & ~CR0_TASK_SWITCHED_FLAG);
 
 		cpu->hide_vm_exit_overhead = true;
 		skip_instruction();
@@ -377,20 +389,20 @@ namespace handlers
 		new_cr0.flags = value;
 
 		cr0 shadow_cr0;
-		shadow_cr0.flags = vm_read(VMCS_CTRL_CR0_READ_SHADOW);
+		shadow_cr0.flags = cpu->vmcs_cache.read<VMCS_CTRL_CR0_READ_SHADOW>();
 		shadow_cr0.protection_enable = new_cr0.protection_enable;
 		shadow_cr0.monitor_coprocessor = new_cr0.monitor_coprocessor;
 		shadow_cr0.emulate_fpu = new_cr0.emulate_fpu;
 		shadow_cr0.task_switched = new_cr0.task_switched;
-		vm_write(VMCS_CTRL_CR0_READ_SHADOW, shadow_cr0.flags);
+		cpu->vmcs_cache.write<VMCS_CTRL_CR0_READ_SHADOW>(shadow_cr0.flags);
 
 		cr0 real_cr0;
-		real_cr0.flags = vm_read(VMCS_GUEST_CR0);
+		real_cr0.flags = cpu->vmcs_cache.read<VMCS_GUEST_CR0>();
 		real_cr0.protection_enable = new_cr0.protection_enable;
 		real_cr0.monitor_coprocessor = new_cr0.monitor_coprocessor;
 		real_cr0.emulate_fpu = new_cr0.emulate_fpu;
 		real_cr0.task_switched = new_cr0.task_switched;
-		vm_write(VMCS_GUEST_CR0, real_cr0.flags);
+		cpu->vmcs_cache.write<VMCS_GUEST_CR0>(real_cr0.flags);
 
 		cpu->hide_vm_exit_overhead = true;
 		skip_instruction();
@@ -399,7 +411,7 @@ namespace handlers
 	auto mov_cr(vcpu_t* cpu) -> void
 	{
 		vmx_exit_qualification_mov_cr qualification;
-		qualification.flags = vm_read(VMCS_EXIT_QUALIFICATION);
+		qualification.flags = cpu->vmcs_cache.read<VMCS_EXIT_QUALIFICATION>();
 
 		switch (qualification.access_type)
 		{
@@ -451,6 +463,12 @@ namespace handlers
 
 	auto exception_or_nmi(vcpu_t* cpu) -> void
 	{
+		// a doorbell from another vcpu, the mailbox is drained before vm-entry.
+		// nmis don't queue, a pmi or watchdog nmi may have collapsed into the
+		// doorbell and there is no telling them apart, so the guest gets one
+		// either way. a spurious nmi is harmless, a lost one is not
+		claim_doorbell(cpu);
+
 		++cpu->queued_nmis;
 
 		auto ctrl = read_ctrl_proc_based();
@@ -488,7 +506,7 @@ namespace handlers
 	auto handlers::ept_violation(vcpu_t* cpu) -> void
 	{
 		vmx_exit_qualification_ept_violation qualification;
-		qualification.flags = vm_read(VMCS_EXIT_QUALIFICATION);
+		qualification.flags = cpu->vmcs_cache.read<VMCS_EXIT_QUALIFICATION>();
 
 		if (!qualification.caused_by_translation)
 		{
@@ -496,7 +514,24 @@ namespace handlers
 			return;
 		}
 
-		auto physical_address = PAGE_ALIGN(vm_read(VMCS_GUEST_PHYSICAL_ADDRESS));
+		auto physical_address = PAGE_ALIGN(cpu->vmcs_cache.read<VMCS_GUEST_PHYSICAL_ADDRESS>());
+
+		// first touch of a gigabyte outside the ram map, fill it in and let the
+		// access retry. if the pool is dry the worker refills it in the meantime
+		if (!qualification.ept_readable && !qualification.ept_writeable && !qualification.ept_executable &&
+			!(reinterpret_cast<u64>(physical_address) >> ghv.ept->max_phys_addr))
+		{
+			ghv.ept->ept_lock.lock();
+			auto const result = ghv.ept->populate(reinterpret_cast<u64>(physical_address));
+			ghv.ept->ept_lock.unlock();
+
+			// a private pdpt copy in some vcpu view won't see the new entry.
+			// another vcpu may have mapped it first, then there is nothing to do
+			if (result == ept_populate_mapped)
+				ghv.ept->invalidate();
+
+			return;
+		}
 
 		auto* hook = ghv.ept->find_ept_hook(physical_address);
 
@@ -506,15 +541,124 @@ namespace handlers
 			return;
 		}
 
-		if (qualification.execute_access)
+		auto const hook_index = static_cast<u64>(hook - ghv.ept->hook_list);
+
+		// installed after the views were last synced, they catch up before vm-entry
+		if (cpu->views_active && !cpu->views[ept_view_read]->hook_ptes[hook_index])
+			return;
+
+		auto const single_step = ghv.ept->track_flip(hook_index);
+
+		// code on this page keeps reading its own page, stay in the exec view
+		// and let just this instruction see the original page. only done in
+		// this vcpu's private view, on the shared tables every other core
+		// would run the unhooked page for the length of the step
+		if (single_step && cpu->views_active && (qualification.read_access || qualification.write_access))
 		{
-			hook->target_page->flags = hook->exec_page.flags;
+			auto const target_page = cpu->views[ept_view_execute]->hook_ptes[hook_index];
+
+			// the hook may have been removed since the lookup, its shadow
+			// frame is on its way back to the pool
+			ghv.ept->ept_lock.lock();
+
+			if (hook->physical_address != physical_address || !ghv.ept->hook_live(hook_index))
+			{
+				ghv.ept->ept_lock.unlock();
+				return;
+			}
+
+			ept_pte step_page;
+			step_page.flags = hook->original_page.flags;
+			step_page.read_access = 1;
+			step_page.write_access = 1;
+			step_page.execute_access = 1;
+
+			target_page->flags = step_page.flags;
+			cpu->mtf_hook = hook;
+			cpu->mtf_hook_phys = reinterpret_cast<u64>(hook->physical_address);
+
+			ghv.ept->ept_lock.unlock();
+
+			auto ctrl = read_ctrl_proc_based();
+			ctrl.monitor_trap_flag = 1;
+			write_ctrl_proc_based(ctrl);
+
+			return;
+		}
+
+		// switch this vcpu to the other view, no pte changes and nothing
+		// to invalidate. other cores keep whatever view they run in
+		if (cpu->views_active)
+		{
+			auto const view = qualification.execute_access ? ept_view_execute : ept_view_read;
+
+			vm_write(VMCS_CTRL_EPT_POINTER, cpu->eptp_list[view]);
+
+			if (cpu->vmfunc_enabled)
+				vm_write(VMCS_CTRL_EPTP_INDEX, view);
+
+			return;
 		}
 
-		if (qualification.read_access || qualification.write_access)
+		// the lookup was lock-free. a hook removed on another core since has
+		// its original pte back and its shadow frame retired, writing the
+		// exec pte now would map a frame that may be reused for anything
+		ghv.ept->ept_lock.lock();
+
+		if (hook->physical_address == physical_address && ghv.ept->hook_live(hook_index))
 		{
-			hook->target_page->flags = hook->rw_page.flags;
+			if (qualification.execute_access)
+			{
+				hook->target_page->flags = hook->exec_page.flags;
+			}
+
+			if (qualification.read_access || qualification.write_access)
+			{
+				hook->target_page->flags = hook->rw_page.flags;
+			}
 		}
+
+		ghv.ept->ept_lock.unlock();
+	}
+
+	auto handlers::monitor_trap_flag(vcpu_t* cpu) -> void
+	{
+		auto ctrl = read_ctrl_proc_based();
+		ctrl.monitor_trap_flag = 0;
+		write_ctrl_proc_based(ctrl);
+
+		auto const hook = cpu->mtf_hook;
+		cpu->mtf_hook = nullptr;
+
+		// removed in the meantime, or the slot went to a hook on another page
+		if (!hook || !hook->physical_address || reinterpret_cast<u64>(hook->physical_address) != cpu->mtf_hook_phys)
+			return;
+
+		auto const hook_index = static_cast<u64>(hook - ghv.ept->hook_list);
+
+		// its group was switched off during the step, the pte is original again
+		if (!ghv.ept->hook_live(hook_index))
+			return;
+
+		// the views were dropped during the step, the shared pte never was
+		// stepped. or the pte left the view, a later sync maps it afresh
+		if (!cpu->views_active)
+			return;
+
+		auto const target_page = cpu->views[ept_view_execute]->hook_ptes[hook_index];
+
+		if (!target_page)
+			return;
+
+		// same pte a sync would give it, #ve delivery included
+		target_page->flags = ghv.ept->hook_pte_flags(cpu->views[ept_view_execute], ept_view_execute, hook);
+
+		// the original frame may still be cached with full access
+		invept_descriptor descriptor{};
+		descriptor.ept_pointer = vm_read(VMCS_CTRL_EPT_POINTER);
+		descriptor.reserved = 0;
+
+		invept(invept_single_context, descriptor);
 	}
 
 	auto handlers::ept_misconfiguration(vcpu_t* cpu) -> void
@@ -28,5 +28,6 @@ namespace handlers
 	auto rdtscp(vcpu_t* cpu) -> void;
 	auto ept_violation(vcpu_t* cpu) -> void;
 	auto ept_misconfiguration(vcpu_t* cpu) -> void;
+	auto monitor_trap_flag(vcpu_t* cpu) -> void;
 }
 
@@ -1,6 +1,7 @@
 #include "hv.h"
 #include "vcpu.h"
 #include "vmx.h"
+#include "vmexit.h"
 
 using namespace vmx;
 
@@ -8,6 +9,20 @@ namespace hv
 {
     hypervisor_t ghv;
 
+    // keeps the vmx-root page pools topped up, vmx-root can't allocate.
+    // the driver has no unload path so the worker runs for as long as the hv
+    static void pool_worker(void*)
+    {
+        LARGE_INTEGER interval;
+        interval.QuadPart = -10'000ll * POOL_REFILL_INTERVAL_MS;
+
+        for (;;)
+        {
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+            ghv.ept->refill_pools();
+        }
+    }
+
     static bool create_hv()
     {
         memset(&ghv, 0, sizeof(ghv));
@@ -16,11 +31,46 @@ namespace hv
 
         auto const arr_size = sizeof(vcpu_t) * ghv.vcpu_count;
 
-        ghv.vcpus = reinterpret_cast<vcpu_t*>(ExAllocatePoolZero(NonPagedPool, arr_size, HV_POOL_TAG));
+        ghv.vcpus = reinterpret_cast<vcpu_t**>(ExAllocatePoolZero(NonPagedPool, sizeof(vcpu_t*) * ghv.vcpu_count, HV_POOL_TAG));
+
+        if (!ghv.vcpus)
+            return false;
+
+        // each vcpu (vmcs, bitmaps, host stack and tables) lives on the node
+        // of its processor, the exit path never works on remote memory
+        for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+        {
+            auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+            auto const node = KeGetCurrentNodeNumber();
+            KeRevertToUserAffinityThreadEx(orig_affinity);
+
+            ghv.vcpus[i] = static_cast<vcpu_t*>(allocate_on_node(sizeof(vcpu_t), node));
+
+            if (!ghv.vcpus[i])
+            {
+                log_error("failed to allocate vcpu %lu", i);
+                return false;
+            }
+        }
 
         ghv.ept = reinterpret_cast<ept_t*>(ExAllocatePoolZero(NonPagedPool, sizeof(ept_t), HV_POOL_TAG));
 
-        ghv.ept->start();
+        if (!ghv.ept)
+        {
+            log_error("failed to allocate the ept");
+            return false;
+        }
+
+        if (!ghv.ept->start())
+        {
+            log_error("failed to build the ept");
+            return false;
+        }
+
+        ia32_apic_base_register apic_base;
+        apic_base.flags = __readmsr(IA32_APIC_BASE);
+
+        ghv.x2apic = apic_base.enable_x2apic_mode;
 
         get_system_cr3(&ghv.system_cr3.flags);
 
@@ -39,11 +89,13 @@ namespace hv
 
         NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 
+        seal_exit_handlers();
+
         for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
         {
             auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
 
-            if (!virtualize_cpu(&ghv.vcpus[i]))
+            if (!virtualize_cpu(ghv.vcpus[i]))
             {
                 KeRevertToUserAffinityThreadEx(orig_affinity);
                 return false;
@@ -52,6 +104,17 @@ namespace hv
             KeRevertToUserAffinityThreadEx(orig_affinity);
         }
 
+        HANDLE worker;
+
+        if (NT_SUCCESS(PsCreateSystemThread(&worker, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, pool_worker, nullptr)))
+        {
+            ZwClose(worker);
+        }
+        else
+        {
+            log_warning("failed to start pool worker, ept pools won't grow");
+        }
+
         return true;
     }
 
@@ -6,13 +6,18 @@
 #include "mm.h"
 #include "ept.h"
 
+#define POOL_REFILL_INTERVAL_MS 50
+
 typedef struct hypervisor_t
 {
 	u32 vcpu_count;
-	vcpu_t* vcpus;
+	vcpu_t** vcpus;
 	cr3 system_cr3;
 	ept_t* ept;
 
+	// doorbell nmis need the x2apic msrs, mailboxes are polled without them
+	bool x2apic;
+
 	alignas(0x1000) pml4e_64 page_table_pml4[512];
 	cr3 page_table_cr3;
 };
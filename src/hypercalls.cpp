@@ -31,31 +31,49 @@ namespace hypercalls
 
 		__writecr3(ghv.system_cr3.flags);
 
-		if (!ghv.ept->split_large_page(phys_addr))
-		{
-			__writecr3(vmroot_cr3);
-			vcpu->ctx->rax = 0;
-			skip_instruction();
-			return;
-		}
+		ghv.ept->ept_lock.lock();
 
-		auto pte = ghv.ept->get_pte(phys_addr);
+		auto const hidden = ghv.ept->hide_page(phys_addr);
 
-		if (!pte)
+		ghv.ept->ept_lock.unlock();
+
+		__writecr3(vmroot_cr3);
+
+		if (hidden)
 		{
-			__writecr3(vmroot_cr3);
-			vcpu->ctx->rax = 0;
-			skip_instruction();
-			return;
+			ghv.ept->invalidate();
+
+			// push the other vcpus through a vm-exit so they flush right away
+			hv::broadcast_async(vcpu, nullptr, nullptr);
 		}
 
-		pte->page_frame_number = ghv.ept->dummy_page_pfn;
+		vcpu->ctx->rax = hidden;
+		skip_instruction();
+	}
+
+	// rcx = physical base, rdx = size in bytes. returns the bytes hidden from
+	// the page aligned base, the whole range costs a single invalidation
+	auto hide_physical_range(vcpu_t* vcpu) -> void
+	{
+		auto vmroot_cr3 = __readcr3();
+
+		__writecr3(ghv.system_cr3.flags);
+
+		ghv.ept->ept_lock.lock();
+
+		auto const hidden = ghv.ept->hide_range(vcpu->ctx->rcx, vcpu->ctx->rdx);
+
+		ghv.ept->ept_lock.unlock();
 
 		__writecr3(vmroot_cr3);
 
-		ghv.ept->invalidate();
+		if (hidden)
+		{
+			ghv.ept->invalidate();
+			hv::broadcast_async(vcpu, nullptr, nullptr);
+		}
 
-		vcpu->ctx->rax = 1;
+		vcpu->ctx->rax = hidden;
 		skip_instruction();
 	}
 
@@ -67,22 +85,101 @@ namespace hypercalls
 
 		ghv.ept->invalidate();
 
+		hv::broadcast_async(vcpu, nullptr, nullptr);
+
 		skip_instruction();
 	}
 
+	// rcx = ept_hint* array, rdx = count, r8 = ept_hook_status array (one u8
+	// per hint), r9 = hook group or 0. a single invalidation covers the batch
+	auto install_ept_hooks(vcpu_t* vcpu) -> void
+	{
+		auto hints = reinterpret_cast<ept_hint**>(vcpu->ctx->rcx);
+		auto statuses = reinterpret_cast<u8*>(vcpu->ctx->r8);
+
+		vcpu->ctx->rax = ghv.ept->install_page_hooks(hints, vcpu->ctx->rdx, statuses, vcpu->ctx->r9);
+
+		if (vcpu->ctx->rax)
+		{
+			ghv.ept->invalidate();
+			hv::broadcast_async(vcpu, nullptr, nullptr);
+		}
+
+		skip_instruction();
+	}
+
+	// rcx = virtual address, returns an ept_remove_result. on a retry the
+	// other vcpus are still kicked so they flush and drain the retired list
 	auto remove_ept_hook(vcpu_t* vcpu) -> void
 	{
 		auto virt = reinterpret_cast<void*>(vcpu->ctx->rcx);
 
 		vcpu->ctx->rax = ghv.ept->remove_ept_hook(virt);
 
+		if (vcpu->ctx->rax != ept_remove_not_found)
+			hv::broadcast_async(vcpu, nullptr, nullptr);
+
+		skip_instruction();
+	}
+
+	// rcx = group name (any non-zero tag), returns the group id or 0
+	auto create_hook_group(vcpu_t* vcpu) -> void
+	{
+		vcpu->ctx->rax = ghv.ept->create_hook_group(vcpu->ctx->rcx);
+
+		skip_instruction();
+	}
+
+	struct hook_group_switch
+	{
+		u64 group;
+		bool active;
+		u64 switched;
+	};
+
+	// runs with every other vcpu parked in its mailbox, they flush before
+	// they resume so the whole group goes live (or away) at once
+	static auto switch_hook_group(vcpu_t*, void* context) -> void
+	{
+		auto request = static_cast<hook_group_switch*>(context);
+
+		request->switched = ghv.ept->set_hook_group(request->group, request->active);
+	}
+
+	// rcx = group id, rdx = non-zero to enable. returns the hooks switched
+	auto set_hook_group(vcpu_t* vcpu) -> void
+	{
+		hook_group_switch request{};
+		request.group = vcpu->ctx->rcx;
+		request.active = vcpu->ctx->rdx != 0;
+		request.switched = 0;
+
+		hv::stop_the_world(vcpu, switch_hook_group, &request);
+
+		vcpu->ctx->rax = request.switched;
+
+		skip_instruction();
+	}
+
+	// rcx = group id. returns the hooks removed in rax and the ones left
+	// for a retry in rdx
+	auto remove_hook_group(vcpu_t* vcpu) -> void
+	{
+		auto remaining = 0ull;
+
+		vcpu->ctx->rax = ghv.ept->remove_hook_group(vcpu->ctx->rcx, remaining);
+		vcpu->ctx->rdx = remaining;
+
+		if (vcpu->ctx->rax || remaining)
+			hv::broadcast_async(vcpu, nullptr, nullptr);
+
 		skip_instruction();
 	}
 
 	auto current_dirbase(vcpu_t* vcpu) -> void
 	{
 		cr3 dirbase;
-		dirbase.flags = vm_read(VMCS_GUEST_CR3);
+		dirbase.flags = vcpu->vmcs_cache.read<VMCS_GUEST_CR3>();
 
 		vcpu->ctx->rax = dirbase.address_of_page_directory << 12;
 
@@ -101,5 +198,121 @@ namespace hypercalls
 
 		skip_instruction();
 	}
-}
 
+	// rcx is the virtual address of a zeroed, page aligned #ve information
+	// area for the calling processor (0 turns #ve off again). the guest's
+	// handler clears the busy dword after switching views with vmfunc
+	auto enable_ve(vcpu_t* vcpu) -> void
+	{
+		auto const info_virt = vcpu->ctx->rcx;
+
+		procbased2_ctls_t allowed2;
+		allowed2.flags = __readmsr(IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+		if (!allowed2.ept_violation || !vcpu->vmfunc_enabled || (info_virt & (PAGE_SIZE - 1)))
+		{
+			vcpu->ctx->rax = 0;
+			skip_instruction();
+			return;
+		}
+
+		procbased2_ctls_t proc_based2;
+		proc_based2.flags = vm_read(VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+		if (info_virt)
+		{
+			cr3 dirbase;
+			dirbase.flags = vcpu->vmcs_cache.read<VMCS_GUEST_CR3>();
+
+			auto const info_phys = hv::translate(virt_addr_t{ info_virt }, dirbase.address_of_page_directory << 12);
+
+			if (!info_phys)
+			{
+				vcpu->ctx->rax = 0;
+				skip_instruction();
+				return;
+			}
+
+			vm_write(VMCS_CTRL_VIRTUALIZATION_EXCEPTION_INFORMATION_ADDRESS, info_phys);
+		}
+
+		vcpu->ve_enabled = info_virt != 0;
+
+		proc_based2.ept_violation = vcpu->ve_enabled;
+		vm_write(VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc_based2.flags);
+
+		// rebuild this vcpu's views with the hook ptes (un)suppressed
+		vcpu->ept_generation = ~0ull;
+
+		vcpu->ctx->rax = 1;
+		skip_instruction();
+	}
+
+	// rcx = ept_stats buffer, rdx = its size. optional dumps: r8 = ept_hook_record
+	// array, r9 = its capacity, r10 = ept_split_record array, r11 = its capacity.
+	// returns the bytes of ept_stats written, the dump counts are part of it
+	auto get_ept_stats(vcpu_t* vcpu) -> void
+	{
+		auto buffer = reinterpret_cast<u8*>(vcpu->ctx->rcx);
+		auto buffer_size = min(vcpu->ctx->rdx, sizeof(ept_stats));
+
+		auto hooks = reinterpret_cast<ept_hook_record*>(vcpu->ctx->r8);
+		auto splits = reinterpret_cast<ept_split_record*>(vcpu->ctx->r10);
+
+		if (!buffer || buffer_size < offsetof(ept_stats, generation))
+		{
+			vcpu->ctx->rax = 0;
+			skip_instruction();
+			return;
+		}
+
+		ept_stats stats{};
+
+		auto vmroot_cr3 = __readcr3();
+
+		__writecr3(ghv.system_cr3.flags);
+
+		ghv.ept->ept_lock.lock();
+
+		ghv.ept->collect_stats(stats);
+
+		if (hooks)
+			stats.hooks_dumped = ghv.ept->dump_hooks(hooks, vcpu->ctx->r9);
+
+		if (splits)
+			stats.splits_dumped = ghv.ept->dump_splits(splits, vcpu->ctx->r11);
+
+		ghv.ept->ept_lock.unlock();
+
+		memcpy(buffer, &stats, buffer_size);
+
+		__writecr3(vmroot_cr3);
+
+		vcpu->ctx->rax = buffer_size;
+		skip_instruction();
+	}
+
+	auto get_exit_stats(vcpu_t* vcpu) -> void
+	{
+		auto snapshot = reinterpret_cast<exit_stats_snapshot*>(vcpu->ctx->rcx);
+		auto buffer_size = min(vcpu->ctx->rdx, sizeof(exit_stats_snapshot));
+
+		if (!snapshot || buffer_size < offsetof(exit_stats_snapshot, vcpu_count))
+		{
+			vcpu->ctx->rax = 0;
+			skip_instruction();
+			return;
+		}
+
+		auto vmroot_cr3 = __readcr3();
+
+		__writecr3(ghv.system_cr3.flags);
+
+		auto const copied = snapshot_exit_stats(snapshot, buffer_size);
+
+		__writecr3(vmroot_cr3);
+
+		vcpu->ctx->rax = copied;
+		skip_instruction();
+	}
+}
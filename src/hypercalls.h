@@ -17,7 +17,15 @@ namespace hypercalls
 		hypercall_instal_ept_hook,
 		hypercall_remove_ept_hook,
 		hypercall_current_dirbase,
-		hypercall_copy_virtual_memory
+		hypercall_copy_virtual_memory,
+		hypercall_enable_ve,
+		hypercall_install_ept_hooks,
+		hypercall_create_hook_group,
+		hypercall_set_hook_group,
+		hypercall_remove_hook_group,
+		hypercall_hide_physical_range,
+		hypercall_ept_stats,
+		hypercall_exit_stats
 	};
 
 	typedef struct input
@@ -38,9 +46,17 @@ namespace hypercalls
 	auto ping(vcpu_t* vcpu) -> void;
 	auto hv_base(vcpu_t* vcpu) -> void;
 	auto hide_physical_page(vcpu_t* vcpu) -> void;
+	auto hide_physical_range(vcpu_t* vcpu) -> void;
 	auto install_ept_hook(vcpu_t* vcpu) -> void;
+	auto install_ept_hooks(vcpu_t* vcpu) -> void;
 	auto remove_ept_hook(vcpu_t* vcpu) -> void;
+	auto create_hook_group(vcpu_t* vcpu) -> void;
+	auto set_hook_group(vcpu_t* vcpu) -> void;
+	auto remove_hook_group(vcpu_t* vcpu) -> void;
 	auto current_dirbase(vcpu_t* vcpu) -> void;
 	auto copy_memory(vcpu_t* vcpu) -> void;
+	auto enable_ve(vcpu_t* vcpu) -> void;
+	auto get_ept_stats(vcpu_t* vcpu) -> void;
+	auto get_exit_stats(vcpu_t* vcpu) -> void;
 }
 
@@ -0,0 +1,286 @@
+#include "mailbox.h"
+#include "hv.h"
+#include "vcpu.h"
+
+#define APIC_ICR_DELIVERY_NMI    (4u << 8)
+#define APIC_ICR_LEVEL_ASSERT    (1u << 14)
+
+namespace hv
+{
+	// stop-the-world initiators are serialized, parked vcpus never drain
+	static spinlock world_lock;
+
+	static auto enqueue(vcpu_mailbox& mailbox, vcpu_request const& request) -> bool
+	{
+		auto position = mailbox.head;
+
+		for (;;)
+		{
+			auto& slot = mailbox.slots[position & MAILBOX_MASK];
+			auto const difference = slot.sequence - position;
+
+			if (difference == 0)
+			{
+				auto const previous = _InterlockedCompareExchange64(&mailbox.head, position + 1, position);
+
+				if (previous == position)
+				{
+					slot.request = request;
+
+					_ReadWriteBarrier();
+					slot.sequence = position + 1;
+
+					return true;
+				}
+
+				position = previous;
+			}
+			else if (difference < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = mailbox.head;
+			}
+		}
+	}
+
+	static auto dequeue(vcpu_mailbox& mailbox, vcpu_request& request) -> bool
+	{
+		auto const position = mailbox.tail;
+		auto& slot = mailbox.slots[position & MAILBOX_MASK];
+
+		if (slot.sequence != position + 1)
+			return false;
+
+		_ReadWriteBarrier();
+		request = slot.request;
+
+		slot.sequence = position + MAILBOX_CAPACITY;
+		mailbox.tail = position + 1;
+
+		return true;
+	}
+
+	// a single msr write, the guest can't be caught halfway through its own
+	// ipi the way it can with the two xapic icr registers
+	static auto send_nmi(u32 apic_id) -> void
+	{
+		__writemsr(IA32_X2APIC_ICR, (static_cast<u64>(apic_id) << 32) |
+			APIC_ICR_DELIVERY_NMI | APIC_ICR_LEVEL_ASSERT);
+	}
+
+	static auto record_wait(vcpu_t* cpu, u64 start) -> void
+	{
+		auto const elapsed = __rdtsc() - start;
+		auto& stats = cpu->mailbox.stats;
+
+		++stats.rendezvous;
+		stats.rendezvous_wait_total += elapsed;
+
+		if (elapsed > stats.rendezvous_wait_max)
+			stats.rendezvous_wait_max = elapsed;
+	}
+
+	// synchronous posts can't give up, keep serving our own mailbox so two
+	// vcpus posting to each other can't deadlock
+	static auto post_blocking(vcpu_t* cpu, vcpu_t* target, vcpu_request const& request) -> void
+	{
+		while (!enqueue(target->mailbox, request))
+		{
+			++cpu->mailbox.stats.send_retries;
+
+			drain_mailbox(cpu);
+			_mm_pause();
+		}
+
+		++cpu->mailbox.stats.sent;
+
+		ring_doorbell(target);
+		++cpu->mailbox.stats.doorbells;
+	}
+
+	auto initialize_mailbox(vcpu_mailbox& mailbox) -> void
+	{
+		memset(&mailbox, 0, sizeof(mailbox));
+
+		for (auto i = 0; i < MAILBOX_CAPACITY; i++)
+		{
+			mailbox.slots[i].sequence = i;
+		}
+	}
+
+	// fire and forget, fails when the target's mailbox is full. a null fn
+	// only forces the target through a vm-exit
+	auto post_request(vcpu_t* cpu, vcpu_t* target, vcpu_request_fn fn, void* context) -> bool
+	{
+		vcpu_request request{};
+		request.fn = fn;
+		request.context = context;
+		request.sync = nullptr;
+		request.posted_tsc = __rdtsc();
+
+		if (!enqueue(target->mailbox, request))
+		{
+			++cpu->mailbox.stats.send_retries;
+			return false;
+		}
+
+		++cpu->mailbox.stats.sent;
+
+		ring_doorbell(target);
+		++cpu->mailbox.stats.doorbells;
+
+		return true;
+	}
+
+	auto broadcast_async(vcpu_t* cpu, vcpu_request_fn fn, void* context) -> void
+	{
+		for (auto i = 0u; i < ghv.vcpu_count; ++i)
+		{
+			if (ghv.vcpus[i] != cpu)
+				post_request(cpu, ghv.vcpus[i], fn, context);
+		}
+
+		if (fn)
+			fn(cpu, context);
+	}
+
+	// runs fn on every vcpu, returns once all of them are done
+	auto broadcast_wait(vcpu_t* cpu, vcpu_request_fn fn, void* context) -> void
+	{
+		rendezvous sync{};
+		sync.pending = static_cast<long>(ghv.vcpu_count - 1);
+		sync.stop_the_world = false;
+
+		vcpu_request request{};
+		request.fn = fn;
+		request.context = context;
+		request.sync = &sync;
+		request.posted_tsc = __rdtsc();
+
+		for (auto i = 0u; i < ghv.vcpu_count; ++i)
+		{
+			if (ghv.vcpus[i] != cpu)
+				post_blocking(cpu, ghv.vcpus[i], request);
+		}
+
+		if (fn)
+			fn(cpu, context);
+
+		auto const start = __rdtsc();
+
+		while (sync.pending)
+		{
+			drain_mailbox(cpu);
+			_mm_pause();
+		}
+
+		record_wait(cpu, start);
+	}
+
+	// parks every other vcpu in vmx-root and runs fn while nothing else
+	// executes, guest or host
+	auto stop_the_world(vcpu_t* cpu, vcpu_request_fn fn, void* context) -> void
+	{
+		while (!world_lock.try_lock())
+		{
+			drain_mailbox(cpu);
+			_mm_pause();
+		}
+
+		rendezvous sync{};
+		sync.pending = static_cast<long>(ghv.vcpu_count - 1);
+		sync.arrived = 0;
+		sync.released = 0;
+		sync.stop_the_world = true;
+
+		vcpu_request request{};
+		request.fn = nullptr;
+		request.context = nullptr;
+		request.sync = &sync;
+		request.posted_tsc = __rdtsc();
+
+		for (auto i = 0u; i < ghv.vcpu_count; ++i)
+		{
+			if (ghv.vcpus[i] != cpu)
+				post_blocking(cpu, ghv.vcpus[i], request);
+		}
+
+		auto const start = __rdtsc();
+
+		while (sync.arrived != static_cast<long>(ghv.vcpu_count - 1))
+			_mm_pause();
+
+		record_wait(cpu, start);
+
+		fn(cpu, context);
+
+		_InterlockedExchange(&sync.released, 1);
+
+		// sync is on our stack, wait until nobody looks at it anymore
+		while (sync.pending)
+			_mm_pause();
+
+		world_lock.unlock();
+	}
+
+	// called before every vm-entry and while spinning on a rendezvous
+	auto drain_mailbox(vcpu_t* cpu) -> void
+	{
+		auto& stats = cpu->mailbox.stats;
+		vcpu_request request;
+
+		while (dequeue(cpu->mailbox, request))
+		{
+			auto const latency = __rdtsc() - request.posted_tsc;
+
+			++stats.handled;
+			stats.latency_total += latency;
+
+			if (latency > stats.latency_max)
+				stats.latency_max = latency;
+
+			auto const sync = request.sync;
+
+			if (sync && sync->stop_the_world)
+			{
+				_InterlockedIncrement(&sync->arrived);
+
+				while (!sync->released)
+					_mm_pause();
+			}
+			else if (request.fn)
+			{
+				request.fn(cpu, request.context);
+			}
+
+			if (sync)
+				_InterlockedDecrement(&sync->pending);
+		}
+	}
+
+	// nmis don't queue, any number of doorbells collapse into one. callers
+	// still reflect the nmi, other nmis collapse into it just the same
+	auto claim_doorbell(vcpu_t* cpu) -> bool
+	{
+		return _InterlockedExchange(&cpu->mailbox.doorbell, 0) != 0;
+	}
+
+	// without x2apic there are no doorbells. an xapic ipi takes a write to icr
+	// high and one to icr low, and this core's guest may have exited between
+	// its own two writes. saving and restoring icr high can't stop our ipi
+	// from going out with the guest's half or the guest's from being sent
+	// to our target. those vcpus poll their mailbox on the preemption timer
+	auto ring_doorbell(vcpu_t* target) -> void
+	{
+		if (!ghv.x2apic)
+			return;
+
+		if (_InterlockedExchange(&target->mailbox.doorbell, 1))
+			return;
+
+		send_nmi(target->apic_id);
+	}
+}
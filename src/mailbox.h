@@ -0,0 +1,90 @@
+#pragma once
+
+#include "types.h"
+
+// requests a vcpu can hold before senders have to back off, power of two
+#define MAILBOX_CAPACITY 64
+#define MAILBOX_MASK (MAILBOX_CAPACITY - 1)
+
+// without x2apic there are no doorbell nmis, every vcpu exits at least this
+// often (in tsc ticks) to drain its mailbox
+#define MAILBOX_POLL_TSC 10000000
+
+struct vcpu_t;
+
+namespace hv
+{
+	using vcpu_request_fn = void(*)(vcpu_t* cpu, void* context);
+
+	// lives on the initiator's stack for wait-for-all and stop-the-world
+	// requests, pending is the last field a target ever touches
+	struct rendezvous
+	{
+		volatile long pending;
+		volatile long arrived;
+		volatile long released;
+		bool stop_the_world;
+	};
+
+	struct vcpu_request
+	{
+		vcpu_request_fn fn;
+		void* context;
+		rendezvous* sync;
+		u64 posted_tsc;
+	};
+
+	struct mailbox_slot
+	{
+		volatile long long sequence;
+		vcpu_request request;
+	};
+
+	// only ever written by the owning vcpu
+	struct mailbox_stats
+	{
+		u64 sent;
+		u64 send_retries;
+		u64 doorbells;
+		u64 handled;
+
+		// time from post to the start of handling, in tsc ticks
+		u64 latency_total;
+		u64 latency_max;
+
+		// rendezvous initiated and time spent waiting for the targets
+		u64 rendezvous;
+		u64 rendezvous_wait_total;
+		u64 rendezvous_wait_max;
+	};
+
+	// bounded multi-producer single-consumer ring, every slot carries a
+	// sequence number so producers claim slots with one compare-exchange
+	struct vcpu_mailbox
+	{
+		alignas(64) volatile long long head;
+		alignas(64) volatile long long tail;
+
+		// set by senders before the nmi, tells a doorbell from a real nmi
+		volatile long doorbell;
+
+		mailbox_slot slots[MAILBOX_CAPACITY];
+
+		mailbox_stats stats;
+	};
+
+	// the exit stub compares these before taking its fast path
+	static_assert(offsetof(vcpu_mailbox, head) == 0x00);
+	static_assert(offsetof(vcpu_mailbox, tail) == 0x40);
+
+	auto initialize_mailbox(vcpu_mailbox& mailbox) -> void;
+
+	auto post_request(vcpu_t* cpu, vcpu_t* target, vcpu_request_fn fn, void* context) -> bool;
+	auto broadcast_async(vcpu_t* cpu, vcpu_request_fn fn, void* context) -> void;
+	auto broadcast_wait(vcpu_t* cpu, vcpu_request_fn fn, void* context) -> void;
+	auto stop_the_world(vcpu_t* cpu, vcpu_request_fn fn, void* context) -> void;
+
+	auto drain_mailbox(vcpu_t* cpu) -> void;
+	auto claim_doorbell(vcpu_t* cpu) -> bool;
+	auto ring_doorbell(vcpu_t* target) -> void;
+}
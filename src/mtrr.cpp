@@ -2,14 +2,118 @@
 
 #define MTRR_PAGE_SIZE 4096
 
+#define MTRR_FIXED_RANGE_COUNT 88
+
 namespace mtrr
 {
-	auto initialize_mtrr(mtrr_list& mtrr_data) -> void
+	struct variable_range
+	{
+		u64 physical_address_min;
+		u64 physical_address_max;
+		u8 type;
+	};
+
+	// overlapping variable ranges, uc always wins and wt wins over wb.
+	// any other overlap is undefined, uncacheable is the safe answer
+	static auto combine_types(u8 current, u8 type) -> u8
+	{
+		if (current == MEMORY_TYPE_INVALID || current == type)
+			return type;
+
+		if (current == MEMORY_TYPE_UNCACHEABLE || type == MEMORY_TYPE_UNCACHEABLE)
+			return MEMORY_TYPE_UNCACHEABLE;
+
+		if ((current == MEMORY_TYPE_WRITE_THROUGH && type == MEMORY_TYPE_WRITE_BACK) ||
+			(current == MEMORY_TYPE_WRITE_BACK && type == MEMORY_TYPE_WRITE_THROUGH))
+			return MEMORY_TYPE_WRITE_THROUGH;
+
+		return MEMORY_TYPE_UNCACHEABLE;
+	}
+
+	// 8 x 64kb, 16 x 16kb and 64 x 4kb covering the first megabyte
+	static auto fixed_range_base(u32 index) -> u64
+	{
+		if (index < 8)
+			return IA32_MTRR_FIX64K_BASE + index * IA32_MTRR_FIX64K_SIZE;
+
+		if (index < 24)
+			return IA32_MTRR_FIX16K_BASE + (index - 8) * IA32_MTRR_FIX16K_SIZE;
+
+		return IA32_MTRR_FIX4K_BASE + (index - 24) * IA32_MTRR_FIX4K_SIZE;
+	}
+
+	static auto fixed_range_index(u64 phys) -> u32
+	{
+		if (phys < IA32_MTRR_FIX16K_BASE)
+			return static_cast<u32>(phys / IA32_MTRR_FIX64K_SIZE);
+
+		if (phys < IA32_MTRR_FIX4K_BASE)
+			return static_cast<u32>(8 + (phys - IA32_MTRR_FIX16K_BASE) / IA32_MTRR_FIX16K_SIZE);
+
+		return static_cast<u32>(24 + (phys - IA32_MTRR_FIX4K_BASE) / IA32_MTRR_FIX4K_SIZE);
+	}
+
+	static auto fixed_range_msr(u32 index) -> u32
+	{
+		if (index < 8)
+			return IA32_MTRR_FIX64K_00000;
+
+		if (index < 24)
+			return IA32_MTRR_FIX16K_80000 + (index - 8) / 8;
+
+		return IA32_MTRR_FIX4K_C0000 + (index - 24) / 8;
+	}
+
+	auto initialize_mtrr(mtrr_map& map, u32 max_phys_addr) -> void
 	{
+		auto const top = 1ull << max_phys_addr;
+
 		ia32_mtrr_capabilities_register mtrr_capabilities{};
 		mtrr_capabilities.flags = __readmsr(IA32_MTRR_CAPABILITIES);
 
-		for (auto i = 0u; i < mtrr_capabilities.variable_range_count; i++)
+		ia32_mtrr_def_type_register mtrr_def_type{};
+		mtrr_def_type.flags = __readmsr(IA32_MTRR_DEF_TYPE);
+
+		map.count = 0;
+
+		// mtrrs disabled, everything is uncacheable
+		if (!mtrr_def_type.mtrr_enable)
+		{
+			map.intervals[0] = { 0, top, MEMORY_TYPE_UNCACHEABLE };
+			map.count = 1;
+			return;
+		}
+
+		auto const fixed_enabled = mtrr_capabilities.fixed_range_supported && mtrr_def_type.fixed_range_mtrr_enable;
+
+		u8 fixed_types[MTRR_FIXED_RANGE_COUNT]{};
+
+		u64 boundaries[MTRR_MAX_INTERVALS + 1];
+		auto boundary_count = 0u;
+
+		boundaries[boundary_count++] = 0;
+		boundaries[boundary_count++] = top;
+
+		if (fixed_enabled)
+		{
+			for (auto i = 0u; i < MTRR_FIXED_RANGE_COUNT; i += 8)
+			{
+				auto const types = __readmsr(fixed_range_msr(i));
+
+				for (auto j = 0u; j < 8; j++)
+				{
+					fixed_types[i + j] = static_cast<u8>(types >> (j * 8));
+					boundaries[boundary_count++] = fixed_range_base(i + j);
+				}
+			}
+
+			boundaries[boundary_count++] = 1_mb;
+		}
+
+		variable_range ranges[MTRR_MAX_VARIABLE_RANGES];
+		auto range_count = 0u;
+
+		for (auto i = 0u; i < mtrr_capabilities.variable_range_count && i < MTRR_MAX_VARIABLE_RANGES; i++)
 		{
 			ia32_mtrr_physbase_register mtrr_base{};
 			ia32_mtrr_physmask_register mtrr_mask{};
@@ -17,34 +121,112 @@ namespace mtrr
 			mtrr_base.flags = __readmsr(IA32_MTRR_PHYSBASE0 + i * 2);
 			mtrr_mask.flags = __readmsr(IA32_MTRR_PHYSMASK0 + i * 2);
 
-			mtrr_data[i].type = static_cast<uint32_t>(mtrr_base.type);
-			mtrr_data[i].enabled = static_cast<uint32_t>(mtrr_mask.valid);
-			if (mtrr_data[i].enabled != FALSE)
+			if (!mtrr_mask.valid)
+				continue;
+
+			auto& range = ranges[range_count++];
+
+			range.type = static_cast<u8>(mtrr_base.type);
+			range.physical_address_min = mtrr_base.page_frame_number * MTRR_PAGE_SIZE;
+
+			unsigned long bit{};
+			_BitScanForward64(&bit, mtrr_mask.page_frame_number * MTRR_PAGE_SIZE);
+			range.physical_address_max = range.physical_address_min + (1ULL << bit) - 1;
+
+			if (range.physical_address_min < top)
+				boundaries[boundary_count++] = range.physical_address_min;
+
+			if (range.physical_address_max + 1 < top)
+				boundaries[boundary_count++] = range.physical_address_max + 1;
+		}
+
+		// a handful of entries, insertion sort is plenty
+		for (auto i = 1u; i < boundary_count; i++)
+		{
+			auto const value = boundaries[i];
+			auto j = i;
+
+			for (; j && boundaries[j - 1] > value; j--)
+				boundaries[j] = boundaries[j - 1];
+
+			boundaries[j] = value;
+		}
+
+		for (auto i = 0u; i + 1 < boundary_count; i++)
+		{
+			auto const base = boundaries[i];
+			auto const end = boundaries[i + 1];
+
+			if (base == end)
+				continue;
+
+			u8 type = MEMORY_TYPE_INVALID;
+
+			// fixed ranges take precedence over variable ranges
+			if (fixed_enabled && base < 1_mb)
 			{
-				mtrr_data[i].physical_address_min = mtrr_base.page_frame_number *
-					MTRR_PAGE_SIZE;
-
-				unsigned long bit{};
-				_BitScanForward64(&bit, mtrr_mask.page_frame_number * MTRR_PAGE_SIZE);
-				mtrr_data[i].physical_address_max = mtrr_data[i].
-					physical_address_min +
-					(1ULL << bit) - 1;
+				type = fixed_types[fixed_range_index(base)];
 			}
+			else
+			{
+				for (auto j = 0u; j < range_count; j++)
+				{
+					if (base >= ranges[j].physical_address_min && base <= ranges[j].physical_address_max)
+						type = combine_types(type, ranges[j].type);
+				}
+
+				if (type == MEMORY_TYPE_INVALID)
+					type = static_cast<u8>(mtrr_def_type.default_memory_type);
+			}
+
+			if (map.count && map.intervals[map.count - 1].type == type)
+			{
+				map.intervals[map.count - 1].end = end;
+				continue;
+			}
+
+			map.intervals[map.count++] = { base, end, type };
 		}
 	}
 
-	auto mtrr_adjust_effective_memory_type(const mtrr_list& mtrr_data, const u64 large_page_address,
-		u32 candidate_memory_type)->u32
+	auto is_mtrr_msr(u32 msr) -> bool
+	{
+		if (msr == IA32_MTRR_DEF_TYPE || msr == IA32_MTRR_FIX64K_00000 ||
+			msr == IA32_MTRR_FIX16K_80000 || msr == IA32_MTRR_FIX16K_A0000)
+			return true;
+
+		if (msr >= IA32_MTRR_FIX4K_C0000 && msr <= IA32_MTRR_FIX4K_F8000)
+			return true;
+
+		return msr >= IA32_MTRR_PHYSBASE0 && msr < IA32_MTRR_PHYSBASE0 + MTRR_MAX_VARIABLE_RANGES * 2;
+	}
+
+	auto mtrr_map::find(u64 phys) const -> u32
 	{
-		for (const auto& mtrr_entry : mtrr_data)
+		auto low = 0u;
+		auto high = this->count - 1;
+
+		// last interval starting at or below phys
+		while (low < high)
 		{
-			if (mtrr_entry.enabled && large_page_address + (2_mb - 1) >= mtrr_entry.physical_address_min &&
-				large_page_address <= mtrr_entry.physical_address_max)
-			{
-				candidate_memory_type = mtrr_entry.type;
-			}
+			auto const middle = (low + high + 1) / 2;
+
+			if (this->intervals[middle].base <= phys)
+				low = middle;
+			else
+				high = middle - 1;
 		}
 
-		return candidate_memory_type;
+		return low;
+	}
+
+	auto mtrr_map::type_of(u64 phys, u64 size) const -> u8
+	{
+		auto const& interval = this->intervals[this->find(phys)];
+
+		if (phys + size > interval.end)
+			return MTRR_MIXED_TYPE;
+
+		return interval.type;
 	}
-}
\ No newline at end of file
+}
@@ -2,6 +2,15 @@
 
 #include "types.h"
 
+// upper bound for IA32_MTRRCAP.VCNT we care about, the sdm allows up to 255
+#define MTRR_MAX_VARIABLE_RANGES 64
+
+// fixed ranges (88) plus both ends of every variable range, merged
+#define MTRR_MAX_INTERVALS (88 + 2 * MTRR_MAX_VARIABLE_RANGES + 2)
+
+// returned for a range that spans more than one memory type
+#define MTRR_MIXED_TYPE 0xFF
+
 namespace mtrr
 {
 	inline u64 operator"" _kb(const uint64_t size)
@@ -19,17 +28,26 @@ namespace mtrr
 		return size * 1024_mb;
 	}
 
-	struct mtrr_range
+	// [base, end) with a single effective memory type
+	struct mtrr_interval
 	{
-		u32 enabled;
-		u32 type;
-		u64 physical_address_min;
-		u64 physical_address_max;
+		u64 base;
+		u64 end;
+		u8 type;
 	};
 
-	using mtrr_list = mtrr_range[16]; //update this to 64?
+	// sorted, non-overlapping and gap-free from 0 up to max_phys_addr, the
+	// fixed ranges, variable ranges, default type and precedence rules are
+	// all resolved when it is built
+	struct mtrr_map
+	{
+		u32 count;
+		mtrr_interval intervals[MTRR_MAX_INTERVALS];
+
+		auto find(u64 phys) const -> u32;
+		auto type_of(u64 phys, u64 size) const -> u8;
+	};
 
-	auto initialize_mtrr(mtrr_list& mtrr_data) -> void;
-	auto mtrr_adjust_effective_memory_type(const mtrr_list& mtrr_data, const u64 large_page_address,
-		u32 candidate_memory_type)->u32;
-}
\ No newline at end of file
+	auto initialize_mtrr(mtrr_map& map, u32 max_phys_addr) -> void;
+	auto is_mtrr_msr(u32 msr) -> bool;
+}
@@ -0,0 +1,163 @@
+#include "pool.h"
+
+using ex_allocate_pool3_t = void* (NTAPI*)(POOL_FLAGS flags, SIZE_T size,
+	ULONG tag, PCPOOL_EXTENDED_PARAMETER parameters, ULONG count);
+
+// ExAllocatePool3 only exists from windows 10 2004 on, importing it would
+// keep the driver from loading on anything older
+static auto get_allocate_pool3() -> ex_allocate_pool3_t
+{
+	static ex_allocate_pool3_t routine;
+	static volatile long resolved;
+
+	if (!resolved)
+	{
+		UNICODE_STRING name = RTL_CONSTANT_STRING(L"ExAllocatePool3");
+		routine = reinterpret_cast<ex_allocate_pool3_t>(MmGetSystemRoutineAddress(&name));
+
+		_InterlockedExchange(&resolved, 1);
+	}
+
+	return routine;
+}
+
+// PASSIVE_LEVEL only, the first call resolves ExAllocatePool3
+auto allocate_on_node(size_t size, u32 node) -> void*
+{
+	auto const allocate_pool3 = get_allocate_pool3();
+
+	if (node != POOL_ANY_NODE && allocate_pool3)
+	{
+		POOL_EXTENDED_PARAMETER parameter{};
+		parameter.Type = PoolExtendedParameterNumaNode;
+		parameter.Optional = 0;
+		parameter.PreferredNode = node;
+
+		auto const memory = allocate_pool3(POOL_FLAG_NON_PAGED, size, HV_POOL_TAG, &parameter, 1);
+
+		if (memory)
+			return memory;
+	}
+
+	// remote memory (or no numa preference at all before 2004) is still
+	// better than none
+	return ExAllocatePoolZero(NonPagedPool, size, HV_POOL_TAG);
+}
+
+auto page_pool::initialize(size_t chunk_pages, size_t low_water, u32 node) -> bool
+{
+	this->chunk_pages = chunk_pages;
+	this->low_water = low_water;
+	this->node = node;
+
+	return this->grow(chunk_pages);
+}
+
+auto page_pool::grow(size_t pages) -> bool
+{
+	NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	if (!pages)
+		return true;
+
+	auto const chunk = static_cast<u8*>(allocate_on_node(pages * PAGE_SIZE, this->node));
+
+	if (!chunk)
+		return false;
+
+	free_page* head = nullptr;
+	free_page* tail = nullptr;
+
+	for (auto i = pages; i-- > 0;)
+	{
+		auto const page = reinterpret_cast<free_page*>(chunk + i * PAGE_SIZE);
+
+		page->phys = MmGetPhysicalAddress(page).QuadPart;
+		page->next = head;
+
+		head = page;
+
+		if (!tail)
+			tail = page;
+	}
+
+	// a vm-exit can interrupt this thread anywhere (nmi doorbells aren't
+	// masked by irql), so nothing here may be a lock vmx-root spins on
+	free_page* staged;
+
+	do
+	{
+		staged = this->staged_list;
+		tail->next = staged;
+	} while (_InterlockedCompareExchangePointer(reinterpret_cast<void* volatile*>(&this->staged_list), head, staged) != staged);
+
+	_InterlockedIncrement64(&this->chunk_count);
+	_InterlockedExchangeAdd64(&this->total_pages, static_cast<long long>(pages));
+	_InterlockedExchangeAdd64(&this->free_pages, static_cast<long long>(pages));
+
+	return true;
+}
+
+// called periodically at PASSIVE_LEVEL so vmx-root never runs dry
+auto page_pool::refill() -> void
+{
+	if (this->available() >= this->low_water)
+		return;
+
+	if (!this->grow(this->chunk_pages))
+		log_warning("failed to grow page pool by %zu pages", this->chunk_pages);
+}
+
+// free page count as of now, a plain read
+auto page_pool::available() -> size_t
+{
+	return static_cast<size_t>(this->free_pages);
+}
+
+auto page_pool::allocate(u64* phys) -> void*
+{
+	this->lock.lock();
+
+	if (!this->free_list)
+		this->free_list = static_cast<free_page*>(_InterlockedExchangePointer(reinterpret_cast<void* volatile*>(&this->staged_list), nullptr));
+
+	auto const page = this->free_list;
+
+	if (page)
+	{
+		this->free_list = page->next;
+
+		auto const used = this->total_pages - _InterlockedDecrement64(&this->free_pages);
+
+		if (used > this->peak_used_pages)
+			this->peak_used_pages = used;
+	}
+	else
+	{
+		_InterlockedIncrement64(&this->failed_allocations);
+	}
+
+	this->lock.unlock();
+
+	if (!page)
+		return nullptr;
+
+	if (phys)
+		*phys = page->phys;
+
+	return page;
+}
+
+auto page_pool::free(void* page, u64 phys) -> void
+{
+	auto const entry = static_cast<free_page*>(page);
+	entry->phys = phys;
+
+	this->lock.lock();
+
+	entry->next = this->free_list;
+	this->free_list = entry;
+	_InterlockedIncrement64(&this->free_pages);
+
+	this->lock.unlock();
+}
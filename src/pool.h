@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+#include "spinlock.h"
+
+// no node preference, memory comes from wherever the os picks
+#define POOL_ANY_NODE 0xFFFFFFFF
+
+// zeroed nonpaged memory, preferably backed by the given numa node
+auto allocate_on_node(size_t size, u32 node) -> void*;
+
+// page allocator usable from vmx-root. backing memory is allocated at
+// PASSIVE_LEVEL in chunks and handed out through a free list, every free
+// page carries its own physical address so no translation is needed later.
+// the free list lock is only ever taken in vmx-root (or before
+// virtualization), new chunks reach it through a lock-free staging list so
+// a guest thread growing the pool never holds anything vmx-root waits on
+class page_pool
+{
+public:
+	auto initialize(size_t chunk_pages, size_t low_water, u32 node = POOL_ANY_NODE) -> bool;
+
+	auto grow(size_t pages) -> bool;
+	auto refill() -> void;
+	auto available() -> size_t;
+
+	auto allocate(u64* phys = nullptr) -> void*;
+	auto free(void* page, u64 phys) -> void;
+
+	size_t chunk_pages;
+	size_t low_water;
+
+	// chunks are allocated on this node
+	u32 node;
+
+	// usage counters, free_pages includes the staged pages. changed with
+	// interlocked operations, grow() runs outside the lock
+	volatile long long chunk_count;
+	volatile long long total_pages;
+	volatile long long free_pages;
+	volatile long long peak_used_pages;
+	volatile long long failed_allocations;
+
+private:
+	struct free_page
+	{
+		free_page* next;
+		u64 phys;
+	};
+
+	spinlock lock;
+	free_page* free_list;
+
+	// chunks pushed by grow(), taken over whole by allocate() once the free
+	// list runs dry
+	free_page* volatile staged_list;
+};
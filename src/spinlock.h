@@ -0,0 +1,63 @@
+#pragma once
+
+#include "types.h"
+
+// minimal spinlock usable from vmx-root, interrupts are expected to be
+// disabled (or the holder running at HIGH_LEVEL) while it is held.
+struct spinlock
+{
+	volatile long locked;
+
+	auto lock() -> void
+	{
+		while (_InterlockedCompareExchange(&this->locked, 1, 0) != 0)
+		{
+			while (this->locked)
+				_mm_pause();
+		}
+	}
+
+	auto try_lock() -> bool
+	{
+		return !this->locked && _InterlockedCompareExchange(&this->locked, 1, 0) == 0;
+	}
+
+	auto unlock() -> void
+	{
+		_InterlockedExchange(&this->locked, 0);
+	}
+};
+
+// sequence counter for lock-free readers of structures that are
+// mutated under a spinlock. writers make the counter odd while mutating.
+struct seqlock
+{
+	volatile long sequence;
+
+	auto read_begin() const -> long
+	{
+		long seq;
+
+		while ((seq = this->sequence) & 1)
+			_mm_pause();
+
+		_ReadWriteBarrier();
+		return seq;
+	}
+
+	auto read_retry(long seq) const -> bool
+	{
+		_ReadWriteBarrier();
+		return this->sequence != seq;
+	}
+
+	auto write_begin() -> void
+	{
+		_InterlockedIncrement(&this->sequence);
+	}
+
+	auto write_end() -> void
+	{
+		_InterlockedIncrement(&this->sequence);
+	}
+};
@@ -15,7 +15,7 @@ namespace hv
 
         cpu->msr_entry_load.aperf.msr_data = cpu->msr_exit_store.aperf.msr_data;
         cpu->msr_entry_load.mperf.msr_data = cpu->msr_exit_store.mperf.msr_data;
-        vm_write(VMCS_GUEST_PERF_GLOBAL_CTRL, perf_global_ctrl.flags);
+        cpu->vmcs_cache.write<VMCS_GUEST_PERF_GLOBAL_CTRL>(perf_global_ctrl.flags);
 
         cpu->msr_entry_load.aperf.msr_data -= cpu->vm_exit_mperf_overhead;
         cpu->msr_entry_load.mperf.msr_data -= cpu->vm_exit_mperf_overhead;
@@ -33,24 +33,24 @@ namespace hv
 
         if (!cpu->hide_vm_exit_overhead || cpu->vm_exit_tsc_overhead > 10000)
         {
-            cpu->tsc_offset = 0;
+            cpu->fast.tsc_offset = 0;
 
-            cpu->preemption_timer = ~0ull;
+            cpu->preemption_timer = cpu->fast.idle_timer;
 
             return;
         }
 
-        cpu->preemption_timer = max(2, 10000 >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship);
+        cpu->preemption_timer = cpu->fast.hide_timer;
 
-        cpu->tsc_offset -= cpu->vm_exit_tsc_overhead;
+        cpu->fast.tsc_offset -= cpu->vm_exit_tsc_overhead;
     }
 
-    auto measure_vm_exit_tsc_overhead() -> u64
+    auto measure_vm_exit_tsc_overhead(hypercalls::command const code) -> u64
     {
         _disable();
 
         hypercalls::input hv_input;
-        hv_input.code = hypercalls::hypercall_ping;
+        hv_input.code = code;
         hv_input.key = hypercalls::hv_key;
 
         uint64_t lowest_vm_exit_overhead = ~0ull;
@@ -92,12 +92,12 @@ namespace hv
         return lowest_vm_exit_overhead - lowest_timing_overhead;
     }
 
-    auto measure_vm_exit_ref_tsc_overhead() -> u64
+    auto measure_vm_exit_ref_tsc_overhead(hypercalls::command const code) -> u64
     {
         _disable();
 
         hypercalls::input hv_input;
-        hv_input.code = hypercalls::hypercall_ping;
+        hv_input.code = code;
         hv_input.key = hypercalls::hv_key;
 
         ia32_fixed_ctr_ctrl_register curr_fixed_ctr_ctrl;
@@ -159,12 +159,12 @@ namespace hv
         return lowest_vm_exit_overhead - lowest_timing_overhead;
     }
 
-    auto measure_vm_exit_mperf_overhead() -> u64
+    auto measure_vm_exit_mperf_overhead(hypercalls::command const code) -> u64
     {
         _disable();
 
         hypercalls::input hv_input;
-        hv_input.code = hypercalls::hypercall_ping;
+        hv_input.code = code;
         hv_input.key = hypercalls::hv_key;
 
         uint64_t lowest_vm_exit_overhead = ~0ull;
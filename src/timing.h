@@ -2,12 +2,16 @@
 
 #include "vcpu.h"
 #include "types.h"
+#include "hypercalls.h"
 
 namespace hv
 {
 	auto hide_vm_exit_overhead(vcpu_t* cpu) -> void;
-	auto measure_vm_exit_tsc_overhead() -> u64;
-	auto measure_vm_exit_ref_tsc_overhead() -> u64;
-	auto measure_vm_exit_mperf_overhead() -> u64;
+
+	// measured with the given hypercall, ping exits take the stub's fast
+	// path while every other one goes through handle_vm_exit
+	auto measure_vm_exit_tsc_overhead(hypercalls::command code) -> u64;
+	auto measure_vm_exit_ref_tsc_overhead(hypercalls::command code) -> u64;
+	auto measure_vm_exit_mperf_overhead(hypercalls::command code) -> u64;
 }
 
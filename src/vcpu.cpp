@@ -20,6 +20,19 @@ namespace hv
 
 		auto current_vcpu = KeGetCurrentProcessorNumber() + 1;
 
+		cpu->node = KeGetCurrentNodeNumber();
+
+		// forces the views to be built on the first vm-entry
+		cpu->ept_generation = ~0ull;
+
+		for (auto i = 0u; i < ept_view_count; ++i)
+		{
+			cpu->views[i] = ghv.ept->create_view(cpu->node);
+
+			if (!cpu->views[i])
+				log_warning("no private ept views for vcpu %d, hooks flip the shared tables", current_vcpu);
+		}
+
 		if (!setup_vmx(cpu))
 			return false;
 
@@ -37,12 +50,39 @@ namespace hv
 
 		cpu->ctx = nullptr;
 		cpu->queued_nmis = 0;
-		cpu->tsc_offset = 0;
 		cpu->preemption_timer = 0;
 		cpu->vm_exit_tsc_overhead = 0;
 		cpu->vm_exit_mperf_overhead = 0;
 		cpu->vm_exit_ref_tsc_overhead = 0;
 
+		cpu->apic_id = ghv.x2apic
+			? static_cast<u32>(__readmsr(IA32_X2APIC_APICID))
+			: static_cast<u32>(cpu->cached.cpuid_01.cpuid_additional_information.initial_apic_id);
+
+		initialize_mailbox(cpu->mailbox);
+
+		hypercalls::input ping_input;
+		ping_input.code = hypercalls::hypercall_ping;
+		ping_input.key = hypercalls::hv_key;
+
+		cpu->fast.tsc_offset = 0;
+		cpu->fast.tsc_overhead = 0;
+		cpu->fast.mperf_overhead = 0;
+		cpu->fast.hide_timer = max(2, 10000 >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship);
+		cpu->fast.ping_rax = *reinterpret_cast<u64*>(&ping_input);
+		cpu->fast.ping_result = hypercalls::hv_signature;
+		cpu->fast.exit_store = &cpu->msr_exit_store;
+		cpu->fast.entry_load = &cpu->msr_entry_load;
+		cpu->fast.generation = &ghv.ept->generation;
+		cpu->fast.seen_generation = &cpu->ept_generation;
+		cpu->fast.mailbox = &cpu->mailbox;
+		cpu->fast.exit_stats = &cpu->exit_stats;
+		cpu->fast.idle_timer = ghv.x2apic
+			? ~0ull : max(2, MAILBOX_POLL_TSC >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship);
+
+		cpu->fast.timer_value = cpu->fast.idle_timer;
+		vm_write(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, cpu->fast.idle_timer);
+
 		if (!vm_launch())
 		{
 			log_error("VMLAUNCH failed. Instruction error = %lli", vm_read(VMCS_VM_INSTRUCTION_ERROR));
@@ -51,12 +91,16 @@ namespace hv
 			return false;
 		}
 
-		cpu->vm_exit_tsc_overhead = measure_vm_exit_tsc_overhead();
-		cpu->vm_exit_mperf_overhead = measure_vm_exit_mperf_overhead();
-		cpu->vm_exit_ref_tsc_overhead = measure_vm_exit_ref_tsc_overhead();
+		// the full path is measured with a hypercall the stub doesn't serve
+		cpu->vm_exit_tsc_overhead = measure_vm_exit_tsc_overhead(hypercalls::hypercall_hv_base);
+		cpu->vm_exit_mperf_overhead = measure_vm_exit_mperf_overhead(hypercalls::hypercall_hv_base);
+		cpu->vm_exit_ref_tsc_overhead = measure_vm_exit_ref_tsc_overhead(hypercalls::hypercall_hv_base);
+
+		cpu->fast.tsc_overhead = measure_vm_exit_tsc_overhead(hypercalls::hypercall_ping);
+		cpu->fast.mperf_overhead = measure_vm_exit_mperf_overhead(hypercalls::hypercall_ping);
 
-		log_info("VM-exit overhead (TSC = %zi)", cpu->vm_exit_tsc_overhead);
-		log_info("VM-exit overhead (MPERF = %zi)", cpu->vm_exit_mperf_overhead);
+		log_info("VM-exit overhead (TSC = %zi, fast path = %zi)", cpu->vm_exit_tsc_overhead, cpu->fast.tsc_overhead);
+		log_info("VM-exit overhead (MPERF = %zi, fast path = %zi)", cpu->vm_exit_mperf_overhead, cpu->fast.mperf_overhead);
 		log_info("VM-exit overhead (CPU_CLK_UNHALTED.REF_TSC = %zi)", cpu->vm_exit_ref_tsc_overhead);
 
 		log_info("vcpu -> %d virtualized!", current_vcpu);
@@ -4,6 +4,10 @@
 #include "gdt.h"
 #include "idt.h"
 #include "vmx.h"
+#include "mailbox.h"
+#include "ept.h"
+#include "vmcs_cache.h"
+#include "vmexit.h"
 
 struct vcpu_cached_data
 {
@@ -24,11 +28,69 @@ struct vcpu_cached_data
     cpuid_eax_01 cpuid_01;
 };
 
+// state the exit stub serves cpuid, rdtsc(p) and pings from without
+// calling into handle_vm_exit. the stub addresses it at fixed offsets
+struct vcpu_fast_exit
+{
+    u64 tsc_offset;
+
+    // overhead of a fast path exit, subtracted from the guest's tsc and
+    // aperf/mperf like the vm_exit_* overheads on the full path
+    u64 tsc_overhead;
+    u64 mperf_overhead;
+
+    // preemption timer value that catches the guest's next instruction
+    u64 hide_timer;
+
+    // rax of the only hypercall served by the stub and its result
+    u64 ping_rax;
+    u64 ping_result;
+
+    void* exit_store;
+    void* entry_load;
+
+    // fast exits are only taken while this vcpu has caught up with the ept
+    // and has no mailbox requests pending
+    volatile long long* generation;
+    u64* seen_generation;
+    hv::vcpu_mailbox* mailbox;
+
+    // preemption timer value last written to the vmcs. the nmi handler
+    // writes it behind the vmcs cache's back, so every writer stores this
+    // before its vmwrite and skips the vmwrite only when it matches
+    u64 timer_value;
+
+    // the stub counts the exits it serves in here
+    hv::exit_stats* exit_stats;
+
+    // preemption timer value while no exit is being hidden, effectively
+    // never unless the mailbox has to be polled
+    u64 idle_timer;
+};
+
+static_assert(offsetof(vcpu_fast_exit, tsc_offset) == 0x00);
+static_assert(offsetof(vcpu_fast_exit, tsc_overhead) == 0x08);
+static_assert(offsetof(vcpu_fast_exit, mperf_overhead) == 0x10);
+static_assert(offsetof(vcpu_fast_exit, hide_timer) == 0x18);
+static_assert(offsetof(vcpu_fast_exit, ping_rax) == 0x20);
+static_assert(offsetof(vcpu_fast_exit, ping_result) == 0x28);
+static_assert(offsetof(vcpu_fast_exit, exit_store) == 0x30);
+static_assert(offsetof(vcpu_fast_exit, entry_load) == 0x38);
+static_assert(offsetof(vcpu_fast_exit, generation) == 0x40);
+static_assert(offsetof(vcpu_fast_exit, seen_generation) == 0x48);
+static_assert(offsetof(vcpu_fast_exit, mailbox) == 0x50);
+static_assert(offsetof(vcpu_fast_exit, timer_value) == 0x58);
+static_assert(offsetof(vcpu_fast_exit, exit_stats) == 0x60);
+static_assert(offsetof(vcpu_fast_exit, idle_timer) == 0x68);
+static_assert(sizeof(hv::exit_reason_stats) == 0x420);
+static_assert(offsetof(hv::exit_reason_stats, fast_count) == 0x08);
+
 typedef struct vcpu_t
 {
     alignas(0x1000) vmxon vmxon;
     alignas(0x1000) vmcs vmcs;
     alignas(0x1000) vmx_msr_bitmap msr_bitmap;
+    alignas(0x1000) u64 eptp_list[512];
     alignas(0x1000) u8 host_stack[0x6000];
 
     alignas(0x1000) segment_descriptor_interrupt_gate_64 host_idt[hv::host_idt_descriptor_count];
@@ -52,19 +114,67 @@ typedef struct vcpu_t
     vcpu_cached_data cached;
     guest_registers* ctx;
 
+    hv::vmcs_field_cache vmcs_cache;
+
     uint32_t volatile queued_nmis;
 
-    u64 tsc_offset;
+    vcpu_fast_exit fast;
+
     u64 preemption_timer;
     u64 vm_exit_tsc_overhead;
     u64 vm_exit_mperf_overhead;
     u64 vm_exit_ref_tsc_overhead;
 
+    // ept generation this vcpu last flushed its translations at
+    u64 ept_generation;
+
+    // private hierarchies indexed by ept_view_index, hooks switch between
+    // them instead of rewriting ptes. views_active is false while any of
+    // them failed to build, the shared hierarchy is used then
+    ept_view* views[ept_view_count];
+    bool views_active;
+
+    // the guest can switch views itself with vmfunc 0
+    bool vmfunc_enabled;
+
+    // hook violations are reflected as #ve to a handler the guest registered
+    // for this processor, exits remain whenever its info area is busy
+    bool ve_enabled;
+
+    // hook whose original page is mapped for a single instruction, the
+    // shadow mapping is put back on the mtf exit. the slot may be reused
+    // by then, the page it hooked tells whether it still is the same hook
+    ept_hook* mtf_hook;
+    u64 mtf_hook_phys;
+
+    // local apic id, the target of doorbell nmis
+    u32 apic_id;
+
+    // numa node of this processor, its views are allocated there
+    u32 node;
+
+    hv::vcpu_mailbox mailbox;
+
+    hv::exit_stats exit_stats;
+
     bool hide_vm_exit_overhead;
 };
 
+// the exit stub reads these straight out of the msr areas
+static_assert(offsetof(vcpu_t, msr_exit_store.perf_global_ctrl.msr_data) - offsetof(vcpu_t, msr_exit_store) == 0x18);
+static_assert(offsetof(vcpu_t, msr_exit_store.aperf.msr_data) - offsetof(vcpu_t, msr_exit_store) == 0x28);
+static_assert(offsetof(vcpu_t, msr_exit_store.mperf.msr_data) - offsetof(vcpu_t, msr_exit_store) == 0x38);
+static_assert(offsetof(vcpu_t, msr_entry_load.aperf.msr_data) - offsetof(vcpu_t, msr_entry_load) == 0x08);
+static_assert(offsetof(vcpu_t, msr_entry_load.mperf.msr_data) - offsetof(vcpu_t, msr_entry_load) == 0x18);
+
 namespace hv
 {
+    // vmcs cache of the vcpu whose exit is being handled on this processor
+    inline auto current_vmcs() -> vmcs_field_cache&
+    {
+        return reinterpret_cast<vcpu_t*>(_readfsbase_u64())->vmcs_cache;
+    }
+
     auto virtualize_cpu(vcpu_t* cpu) -> bool;
     auto cache_cpu_data(vcpu_cached_data& cached) -> void;
 
@@ -36,6 +36,18 @@ namespace hv
 		proc_based2.enable_xsaves = 1;
 		proc_based2.enable_user_wait_pause = 1;
 		proc_based2.conceal_vmx_from_pt = 1;
+
+		// eptp switching lets a guest-side trampoline move between the hook
+		// views without an exit, only turned on where the cpu has it
+		procbased2_ctls_t allowed2;
+		allowed2.flags = __readmsr(IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+		ia32_vmx_vmfunc_register vmfunc;
+		vmfunc.flags = allowed2.enable_vm_functions ? __readmsr(IA32_VMX_VMFUNC) : 0;
+
+		cpu->vmfunc_enabled = vmfunc.eptp_switching && cpu->views[ept_view_read] && cpu->views[ept_view_execute];
+		proc_based2.enable_vm_functions = cpu->vmfunc_enabled;
+
 		proc_based2_ctrls(proc_based2);
 
 		auto exit_ctrl = exit_ctls_t{};
@@ -59,6 +71,13 @@ namespace hv
 
 		vm_write(VMCS_CTRL_EPT_POINTER, ghv.ept->get_ept_pointer().flags);
 
+		if (cpu->vmfunc_enabled)
+		{
+			vm_write(VMCS_CTRL_VMFUNC_CONTROLS, IA32_VMX_VMFUNC_EPTP_SWITCHING_FLAG);
+			vm_write(VMCS_CTRL_EPT_POINTER_LIST_ADDRESS, MmGetPhysicalAddress(&cpu->eptp_list).QuadPart);
+			vm_write(VMCS_CTRL_EPTP_INDEX, ept_view_read);
+		}
+
 		vm_write(VMCS_CTRL_CR0_GUEST_HOST_MASK, cpu->cached.vmx_cr0_fixed0 | ~cpu->cached.vmx_cr0_fixed1 |
 			CR0_CACHE_DISABLE_FLAG | CR0_WRITE_PROTECT_FLAG);
 
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "types.h"
+#include "vmx.h"
+
+namespace hv
+{
+	// vmcs fields handlers keep coming back to during a single exit, a
+	// field's slot is its index in here
+	inline constexpr u64 vmcs_cached_fields[] =
+	{
+		VMCS_GUEST_RIP,
+		VMCS_GUEST_RSP,
+		VMCS_GUEST_RFLAGS,
+		VMCS_GUEST_INTERRUPTIBILITY_STATE,
+		VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS,
+		VMCS_GUEST_DEBUGCTL,
+		VMCS_GUEST_CS_ACCESS_RIGHTS,
+		VMCS_GUEST_SS_ACCESS_RIGHTS,
+		VMCS_GUEST_CR0,
+		VMCS_GUEST_CR3,
+		VMCS_GUEST_CR4,
+		VMCS_GUEST_PERF_GLOBAL_CTRL,
+		VMCS_CTRL_CR0_GUEST_HOST_MASK,
+		VMCS_CTRL_CR0_READ_SHADOW,
+		VMCS_CTRL_CR4_GUEST_HOST_MASK,
+		VMCS_CTRL_CR4_READ_SHADOW,
+		VMCS_CTRL_TSC_OFFSET,
+		VMCS_EXIT_REASON,
+		VMCS_EXIT_QUALIFICATION,
+		VMCS_VMEXIT_INSTRUCTION_LENGTH,
+		VMCS_GUEST_PHYSICAL_ADDRESS,
+	};
+
+	inline constexpr u32 vmcs_cached_field_count = sizeof(vmcs_cached_fields) / sizeof(vmcs_cached_fields[0]);
+
+	static_assert(vmcs_cached_field_count <= 32);
+
+	constexpr auto vmcs_cache_slot(u64 const field) -> u32
+	{
+		for (auto i = 0u; i < vmcs_cached_field_count; ++i)
+		{
+			if (vmcs_cached_fields[i] == field)
+				return i;
+		}
+
+		return vmcs_cached_field_count;
+	}
+
+	constexpr auto vmcs_cache_bit(u64 const field) -> u32
+	{
+		return 1u << vmcs_cache_slot(field);
+	}
+
+	// exit information, never written back
+	inline constexpr u32 vmcs_cache_read_only =
+		vmcs_cache_bit(VMCS_EXIT_REASON) |
+		vmcs_cache_bit(VMCS_EXIT_QUALIFICATION) |
+		vmcs_cache_bit(VMCS_VMEXIT_INSTRUCTION_LENGTH) |
+		vmcs_cache_bit(VMCS_GUEST_PHYSICAL_ADDRESS);
+
+	// controls only the hypervisor ever changes, they stay valid across
+	// exits. nothing outside the cache may write them after vmlaunch
+	inline constexpr u32 vmcs_cache_persistent =
+		vmcs_cache_bit(VMCS_CTRL_CR0_GUEST_HOST_MASK) |
+		vmcs_cache_bit(VMCS_CTRL_CR0_READ_SHADOW) |
+		vmcs_cache_bit(VMCS_CTRL_CR4_GUEST_HOST_MASK) |
+		vmcs_cache_bit(VMCS_CTRL_CR4_READ_SHADOW);
+
+	// per-vcpu copy of the vmcs fields touched during an exit. fields are
+	// read on first use and written back before vm-entry when they changed
+	struct vmcs_field_cache
+	{
+		u64 values[vmcs_cached_field_count];
+		u32 valid;
+		u32 dirty;
+
+		// vmreads and vmwrites actually issued for cached fields
+		u64 reads;
+		u64 writes;
+
+		template <u64 field>
+		auto read() -> u64
+		{
+			constexpr auto slot = vmcs_cache_slot(field);
+			static_assert(slot < vmcs_cached_field_count, "field is not cached");
+
+			if (!(this->valid & (1u << slot)))
+			{
+				this->values[slot] = vmx::vm_read(field);
+				this->valid |= 1u << slot;
+				++this->reads;
+			}
+
+			return this->values[slot];
+		}
+
+		template <u64 field>
+		auto write(u64 const value) -> void
+		{
+			constexpr auto slot = vmcs_cache_slot(field);
+			static_assert(slot < vmcs_cached_field_count, "field is not cached");
+			static_assert(!(vmcs_cache_read_only & (1u << slot)), "field is read-only");
+
+			if ((this->valid & (1u << slot)) && this->values[slot] == value)
+				return;
+
+			this->values[slot] = value;
+			this->valid |= 1u << slot;
+			this->dirty |= 1u << slot;
+		}
+
+		// seeds a field with a value known to be in the vmcs
+		template <u64 field>
+		auto prime(u64 const value) -> void
+		{
+			constexpr auto slot = vmcs_cache_slot(field);
+			static_assert(slot < vmcs_cached_field_count, "field is not cached");
+
+			this->values[slot] = value;
+			this->valid |= 1u << slot;
+		}
+
+		// called at the start of every exit, guest state and exit
+		// information are stale by then
+		auto invalidate() -> void
+		{
+			this->valid &= vmcs_cache_persistent;
+			this->dirty = 0;
+		}
+
+		auto flush() -> void
+		{
+			auto dirty = this->dirty;
+
+			while (dirty)
+			{
+				unsigned long slot;
+				_BitScanForward(&slot, dirty);
+				dirty &= dirty - 1;
+
+				vmx::vm_write(vmcs_cached_fields[slot], this->values[slot]);
+				++this->writes;
+			}
+
+			this->dirty = 0;
+		}
+	};
+}
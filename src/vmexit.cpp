@@ -3,48 +3,260 @@
 #include "handlers.h"
 #include "trap-frame.h"
 #include "timing.h"
+#include "hv.h"
 
 using namespace vmx;
 
 namespace hv
 {
+	// exits whose handlers neither fault in vmx-root nor touch the guest's
+	// debug, cr2/cr8 or upper xmm state only get the gprs saved. handlers
+	// that do need a profile, everything else keeps the full save
+	static constexpr auto build_save_profiles() -> exit_save_profiles
+	{
+		exit_save_profiles table{};
+
+		for (auto& profile : table.profile)
+			profile = guest_state_all;
+
+		table.profile[VMX_EXIT_REASON_EXECUTE_CPUID] = 0;
+		table.profile[VMX_EXIT_REASON_EXECUTE_RDTSC] = 0;
+		table.profile[VMX_EXIT_REASON_EXECUTE_RDTSCP] = 0;
+		table.profile[VMX_EXIT_REASON_EXECUTE_RDMSR] = 0;
+		table.profile[VMX_EXIT_REASON_EXECUTE_WRMSR] = 0;
+		table.profile[VMX_EXIT_REASON_EXECUTE_XSETBV] = 0;
+		table.profile[VMX_EXIT_REASON_EXECUTE_INVD] = 0;
+		table.profile[VMX_EXIT_REASON_EXECUTE_GETSEC] = 0;
+		table.profile[VMX_EXIT_REASON_NMI_WINDOW] = 0;
+		table.profile[VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED] = 0;
+		table.profile[VMX_EXIT_REASON_EPT_VIOLATION] = 0;
+		table.profile[VMX_EXIT_REASON_EPT_MISCONFIGURATION] = 0;
+		table.profile[VMX_EXIT_REASON_MONITOR_TRAP_FLAG] = 0;
+
+		// memory copies may take a host #pf, which overwrites cr2
+		table.profile[VMX_EXIT_REASON_EXECUTE_VMCALL] = guest_state_cr;
+
+		return table;
+	}
+}
+
+extern "C" hv::exit_save_profiles vm_exit_save_profiles = hv::build_save_profiles();
+extern "C" const u64 vm_exit_fast_offset = offsetof(vcpu_t, fast);
+
+extern "C" u64 vm_exit_fast_reasons =
+	(1ull << VMX_EXIT_REASON_EXECUTE_CPUID) |
+	(1ull << VMX_EXIT_REASON_EXECUTE_RDTSC) |
+	(1ull << VMX_EXIT_REASON_EXECUTE_RDTSCP) |
+	(1ull << VMX_EXIT_REASON_EXECUTE_VMCALL);
+
+namespace hv
+{
+	static auto unknown_exit(vcpu_t* const cpu) -> void
+	{
+		inject_hw_exception(general_protection, 0);
+	}
+
+	static constexpr auto build_dispatch_table() -> exit_dispatch_table
+	{
+		exit_dispatch_table table{};
+
+		for (auto& handler : table.handler)
+			handler = unknown_exit;
+
+		table.handler[VMX_EXIT_REASON_EXCEPTION_OR_NMI]             = handlers::exception_or_nmi;
+		table.handler[VMX_EXIT_REASON_EXECUTE_GETSEC]               = handlers::getsec;
+		table.handler[VMX_EXIT_REASON_EXECUTE_INVD]                 = handlers::invd;
+		table.handler[VMX_EXIT_REASON_NMI_WINDOW]                   = handlers::nmi_window;
+		table.handler[VMX_EXIT_REASON_EXECUTE_CPUID]                = handlers::cpuid;
+		table.handler[VMX_EXIT_REASON_MOV_CR]                       = handlers::mov_cr;
+		table.handler[VMX_EXIT_REASON_EXECUTE_RDMSR]                = handlers::rdmsr;
+		table.handler[VMX_EXIT_REASON_EXECUTE_WRMSR]                = handlers::wrmsr;
+		table.handler[VMX_EXIT_REASON_EXECUTE_XSETBV]               = handlers::xsetbv;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMXON]                = handlers::vmxon;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMCALL]               = handlers::vmcall;
+		table.handler[VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED] = handlers::vmx_preemption;
+		table.handler[VMX_EXIT_REASON_EXECUTE_RDTSC]                = handlers::rdtsc;
+		table.handler[VMX_EXIT_REASON_EXECUTE_RDTSCP]               = handlers::rdtscp;
+		table.handler[VMX_EXIT_REASON_EPT_VIOLATION]                = handlers::ept_violation;
+		table.handler[VMX_EXIT_REASON_EPT_MISCONFIGURATION]         = handlers::ept_misconfiguration;
+		table.handler[VMX_EXIT_REASON_MONITOR_TRAP_FLAG]            = handlers::monitor_trap_flag;
+		table.handler[VMX_EXIT_REASON_EXECUTE_INVEPT]               = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_INVVPID]              = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMCLEAR]              = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMLAUNCH]             = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMPTRLD]              = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMPTRST]              = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMREAD]               = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMRESUME]             = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMWRITE]              = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMXOFF]               = handlers::vmx_instruction;
+		table.handler[VMX_EXIT_REASON_EXECUTE_VMFUNC]               = handlers::vmx_instruction;
+
+		for (auto i = 0u; i <= VMX_EXIT_REASON_COUNT; ++i)
+			table.dispatch[i] = table.handler[i];
+
+		return table;
+	}
+
+	static exit_dispatch_table exit_table = build_dispatch_table();
+	static bool exit_table_sealed = false;
+
+	static auto exit_table_index(u32 const reason) -> u32
+	{
+		return min(reason, static_cast<u32>(VMX_EXIT_REASON_UNKNOWN));
+	}
+
+	static auto observed_exit(vcpu_t* const cpu) -> void
+	{
+		vmx_vmexit_reason reason;
+		reason.flags = static_cast<u32>(cpu->vmcs_cache.read<VMCS_EXIT_REASON>());
+
+		auto const index = exit_table_index(reason.basic_exit_reason);
+
+		if (exit_table.pre[index])
+			exit_table.pre[index](cpu);
+
+		exit_table.handler[index](cpu);
+
+		if (exit_table.post[index])
+			exit_table.post[index](cpu);
+	}
+
+	// the stub can't run observers or a replaced handler
+	static auto take_over_exit(u32 const index, u8 const save) -> void
+	{
+		if (index < 64)
+			vm_exit_fast_reasons &= ~(1ull << index);
+
+		if (index < VMX_EXIT_REASON_COUNT)
+			vm_exit_save_profiles.profile[index] |= save;
+	}
+
+	auto register_exit_handler(u32 const reason, exit_handler_fn const handler, u8 const save) -> bool
+	{
+		if (exit_table_sealed || reason > VMX_EXIT_REASON_UNKNOWN || !handler)
+			return false;
+
+		exit_table.handler[reason] = handler;
+
+		if (exit_table.dispatch[reason] != observed_exit)
+			exit_table.dispatch[reason] = handler;
+
+		take_over_exit(reason, save);
+		return true;
+	}
+
+	auto register_exit_observers(u32 const reason, exit_handler_fn const pre, exit_handler_fn const post) -> bool
+	{
+		if (exit_table_sealed || reason > VMX_EXIT_REASON_UNKNOWN)
+			return false;
+
+		if ((pre && exit_table.pre[reason]) || (post && exit_table.post[reason]))
+			return false;
+
+		if (pre)
+			exit_table.pre[reason] = pre;
+		if (post)
+			exit_table.post[reason] = post;
+
+		if (exit_table.pre[reason] || exit_table.post[reason])
+		{
+			exit_table.dispatch[reason] = observed_exit;
+
+			// observers can't know what state the handler relies on
+			take_over_exit(reason, guest_state_all);
+		}
+
+		return true;
+	}
+
+	auto seal_exit_handlers() -> void
+	{
+		exit_table_sealed = true;
+	}
+
 	static void dispatch_vm_exit(vcpu_t* const cpu, vmx_vmexit_reason const reason)
 	{
-		switch (reason.basic_exit_reason)
+		exit_table.dispatch[exit_table_index(reason.basic_exit_reason)](cpu);
+	}
+
+	auto exit_histogram_bucket(u64 const cycles) -> u32
+	{
+		constexpr u64 sub_buckets = 1ull << EXIT_HISTOGRAM_SUB_BITS;
+
+		if (cycles < sub_buckets)
+			return static_cast<u32>(cycles);
+
+		unsigned long msb;
+		_BitScanReverse64(&msb, cycles);
+
+		auto const bucket = ((msb - EXIT_HISTOGRAM_SUB_BITS + 1) << EXIT_HISTOGRAM_SUB_BITS)
+			| ((cycles >> (msb - EXIT_HISTOGRAM_SUB_BITS)) & (sub_buckets - 1));
+
+		return min(static_cast<u32>(bucket), EXIT_HISTOGRAM_BUCKETS - 1u);
+	}
+
+	static auto record_exit(vcpu_t* const cpu, u32 const index) -> void
+	{
+		auto const cycles = __rdtsc() - cpu->msr_exit_store.tsc.msr_data;
+		auto& stats = cpu->exit_stats.reasons[index];
+
+		++stats.count;
+		stats.cycles_total += cycles;
+		stats.cycles_max = max(stats.cycles_max, cycles);
+		++stats.histogram[exit_histogram_bucket(cycles)];
+	}
+
+	auto snapshot_exit_stats(exit_stats_snapshot* const snapshot, u64 const size) -> u64
+	{
+		auto const copy = [&](u64 const offset, void const* const src, u64 const length) -> u64
+		{
+			if (offset >= size)
+				return 0;
+
+			auto const copied = min(length, size - offset);
+			memcpy(reinterpret_cast<u8*>(snapshot) + offset, src, copied);
+			return copied;
+		};
+
+		exit_stats_snapshot header{};
+		header.version = EXIT_STATS_VERSION;
+		header.size = sizeof(exit_stats_snapshot);
+		header.vcpu_count = ghv.vcpu_count;
+		header.histogram_sub_bits = EXIT_HISTOGRAM_SUB_BITS;
+		header.histogram_buckets = EXIT_HISTOGRAM_BUCKETS;
+
+		for (auto i = 0u; i < ghv.vcpu_count; ++i)
 		{
-			case VMX_EXIT_REASON_EXCEPTION_OR_NMI:             handlers::exception_or_nmi(cpu);    break;
-			case VMX_EXIT_REASON_EXECUTE_GETSEC:               handlers::getsec(cpu);              break;
-			case VMX_EXIT_REASON_EXECUTE_INVD:                 handlers::invd(cpu);                break;
-			case VMX_EXIT_REASON_NMI_WINDOW:                   handlers::nmi_window(cpu);          break;
-			case VMX_EXIT_REASON_EXECUTE_CPUID:                handlers::cpuid(cpu);               break;
-			case VMX_EXIT_REASON_MOV_CR:                       handlers::mov_cr(cpu);              break;
-			case VMX_EXIT_REASON_EXECUTE_RDMSR:                handlers::rdmsr(cpu);               break;
-			case VMX_EXIT_REASON_EXECUTE_WRMSR:                handlers::wrmsr(cpu);               break;
-			case VMX_EXIT_REASON_EXECUTE_XSETBV:               handlers::xsetbv(cpu);              break;
-			case VMX_EXIT_REASON_EXECUTE_VMXON:                handlers::vmxon(cpu);               break;
-			case VMX_EXIT_REASON_EXECUTE_VMCALL:               handlers::vmcall(cpu);              break;
-			case VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED: handlers::vmx_preemption(cpu);      break;
-			case VMX_EXIT_REASON_EXECUTE_RDTSC:                handlers::rdtsc(cpu);               break;
-			case VMX_EXIT_REASON_EXECUTE_RDTSCP:               handlers::rdtscp(cpu);              break;
-			case VMX_EXIT_REASON_EPT_VIOLATION:                handlers::ept_violation(cpu);       break;
-			case VMX_EXIT_REASON_EPT_MISCONFIGURATION:         handlers::ept_misconfiguration(cpu);break;
-			case VMX_EXIT_REASON_EXECUTE_INVEPT:
-			case VMX_EXIT_REASON_EXECUTE_INVVPID:
-			case VMX_EXIT_REASON_EXECUTE_VMCLEAR:
-			case VMX_EXIT_REASON_EXECUTE_VMLAUNCH:
-			case VMX_EXIT_REASON_EXECUTE_VMPTRLD:
-			case VMX_EXIT_REASON_EXECUTE_VMPTRST:
-			case VMX_EXIT_REASON_EXECUTE_VMREAD:
-			case VMX_EXIT_REASON_EXECUTE_VMRESUME:
-			case VMX_EXIT_REASON_EXECUTE_VMWRITE:
-			case VMX_EXIT_REASON_EXECUTE_VMXOFF:
-			case VMX_EXIT_REASON_EXECUTE_VMFUNC:               handlers::vmx_instruction(cpu);    break;
-			default:
+			header.vmcs_reads += ghv.vcpus[i]->vmcs_cache.reads;
+			header.vmcs_writes += ghv.vcpus[i]->vmcs_cache.writes;
+		}
+
+		auto copied = copy(0, &header, offsetof(exit_stats_snapshot, reasons));
+
+		// the whole snapshot doesn't fit on the host stack, it's summed up
+		// and copied out one reason at a time
+		for (auto reason = 0u; reason <= VMX_EXIT_REASON_COUNT; ++reason)
+		{
+			exit_reason_stats total{};
+
+			for (auto i = 0u; i < ghv.vcpu_count; ++i)
 			{
-				inject_hw_exception(general_protection, 0);
-				break;
+				auto const& stats = ghv.vcpus[i]->exit_stats.reasons[reason];
+
+				total.count += stats.count;
+				total.fast_count += stats.fast_count;
+				total.cycles_total += stats.cycles_total;
+				total.cycles_max = max(total.cycles_max, stats.cycles_max);
+
+				for (auto bucket = 0u; bucket < EXIT_HISTOGRAM_BUCKETS; ++bucket)
+					total.histogram[bucket] += stats.histogram[bucket];
 			}
+
+			copied += copy(offsetof(exit_stats_snapshot, reasons) + reason * sizeof(total), &total, sizeof(total));
 		}
+
+		return copied;
 	}
 
 	bool handle_vm_exit(guest_registers* const ctx)
@@ -52,8 +264,12 @@ namespace hv
 		auto const cpu = reinterpret_cast<vcpu_t*>(_readfsbase_u64());
 		cpu->ctx = ctx;
 
+		// the tsc offset in the vmcs is always the one both paths last wrote
+		cpu->vmcs_cache.invalidate();
+		cpu->vmcs_cache.prime<VMCS_CTRL_TSC_OFFSET>(cpu->fast.tsc_offset);
+
 		vmx_vmexit_reason reason;
-		reason.flags = static_cast<uint32_t>(vm_read(VMCS_EXIT_REASON));
+		reason.flags = static_cast<uint32_t>(cpu->vmcs_cache.read<VMCS_EXIT_REASON>());
 
 		cpu->hide_vm_exit_overhead = false;
 
@@ -61,8 +277,28 @@ namespace hv
 
 		hide_vm_exit_overhead(cpu);
 
-		vm_write(VMCS_CTRL_TSC_OFFSET, cpu->tsc_offset);
-		vm_write(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, cpu->preemption_timer);
+		cpu->vmcs_cache.write<VMCS_CTRL_TSC_OFFSET>(cpu->fast.tsc_offset);
+
+		if (cpu->preemption_timer != cpu->fast.timer_value)
+		{
+			cpu->fast.timer_value = cpu->preemption_timer;
+			vm_write(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, cpu->preemption_timer);
+		}
+
+		// written back before the mailbox is drained, a doorbell arriving
+		// after that re-arms the timer itself
+		cpu->vmcs_cache.flush();
+
+		drain_mailbox(cpu);
+
+		// catch up with ept changes made by any vcpu since the last entry
+		if (cpu->ept_generation != static_cast<u64>(ghv.ept->generation))
+			ghv.ept->flush(cpu);
+
+		// anything requests changed
+		cpu->vmcs_cache.flush();
+
+		record_exit(cpu, exit_table_index(reason.basic_exit_reason));
 
 		cpu->ctx = nullptr;
 
@@ -75,11 +311,21 @@ namespace hv
 		{
 		case nmi:
 		{
+			auto const cpu = reinterpret_cast<vcpu_t*>(_readfsbase_u64());
+
+			// the mailbox may already have been drained for this exit, make
+			// the guest exit again right after entry. the nmi is still
+			// reflected, another source may have collapsed into the doorbell
+			if (claim_doorbell(cpu))
+			{
+				cpu->fast.timer_value = 0;
+				vm_write(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, 0);
+			}
+
 			auto ctrl = read_ctrl_proc_based();
 			ctrl.nmi_window_exiting = 1;
 			write_ctrl_proc_based(ctrl);
 
-			auto const cpu = reinterpret_cast<vcpu_t*>(_readfsbase_u64());
 			++cpu->queued_nmis;
 
 			break;
@@ -2,9 +2,115 @@
 
 #include "guest_registers.h"
 
+// basic exit reasons with a save profile, the stub saves everything for
+// any reason past the end
+#define VMX_EXIT_REASON_COUNT (VMX_EXIT_REASON_EXECUTE_XRSTORS + 1)
+
+// dispatch table slot shared by every reason past the end
+#define VMX_EXIT_REASON_UNKNOWN VMX_EXIT_REASON_COUNT
+
+// log-linear latency histograms, each power of two of cycles is split into
+// 1 << EXIT_HISTOGRAM_SUB_BITS buckets. the last bucket takes everything
+// past it
+#define EXIT_HISTOGRAM_SUB_BITS 2
+#define EXIT_HISTOGRAM_BUCKETS 128
+
+// layout handed out by the exit stats hypercall. fields are only ever
+// appended, callers check version and size before reading the tail
+#define EXIT_STATS_VERSION 1
+
+struct vcpu_t;
+
 namespace hv
 {
+	// guest_state bits the exit stub saves for each basic exit reason
+	struct exit_save_profiles
+	{
+		u8 profile[VMX_EXIT_REASON_COUNT];
+	};
+
+	using exit_handler_fn = void(*)(vcpu_t* cpu);
+
+	// indexed by basic exit reason. dispatch holds the handler itself, or
+	// a trampoline that runs the observers around it when there are any.
+	// only changed through the register functions, which refuse once the
+	// table is sealed
+	struct alignas(64) exit_dispatch_table
+	{
+		exit_handler_fn dispatch[VMX_EXIT_REASON_COUNT + 1];
+		exit_handler_fn handler[VMX_EXIT_REASON_COUNT + 1];
+		exit_handler_fn pre[VMX_EXIT_REASON_COUNT + 1];
+		exit_handler_fn post[VMX_EXIT_REASON_COUNT + 1];
+	};
+
+	typedef struct exit_reason_stats
+	{
+		// exits through handle_vm_exit, timed from the exit's tsc to just
+		// before vm-entry
+		u64 count;
+
+		// exits the stub served itself, these aren't timed
+		u64 fast_count;
+
+		u64 cycles_total;
+		u64 cycles_max;
+		u64 histogram[EXIT_HISTOGRAM_BUCKETS];
+	};
+
+	// per vcpu, only ever written by the owning vcpu
+	typedef struct exit_stats
+	{
+		exit_reason_stats reasons[VMX_EXIT_REASON_COUNT + 1];
+	};
+
+	typedef struct exit_stats_snapshot
+	{
+		u32 version;
+		u32 size;
+
+		u64 vcpu_count;
+		u64 histogram_sub_bits;
+		u64 histogram_buckets;
+
+		// vmreads and vmwrites the vmcs caches issued
+		u64 vmcs_reads;
+		u64 vmcs_writes;
+
+		// summed over all vcpus, indexed like the dispatch table
+		exit_reason_stats reasons[VMX_EXIT_REASON_COUNT + 1];
+	};
+
 	bool vm_launch();
 	void vm_exit();
 	bool handle_vm_exit(guest_registers* const ctx);
+
+	// replaces the handler of a basic exit reason, or of all unknown ones
+	// with VMX_EXIT_REASON_UNKNOWN. save is the guest_state the handler
+	// needs on top of the gprs
+	auto register_exit_handler(u32 reason, exit_handler_fn handler, u8 save = guest_state_all) -> bool;
+
+	// observers run right before and after the handler of a reason, one
+	// of each per reason. either may be null
+	auto register_exit_observers(u32 reason, exit_handler_fn pre, exit_handler_fn post) -> bool;
+
+	// called once all vcpus are about to be virtualized, the register
+	// functions fail from then on. this is a registration lock and nothing
+	// more, the dispatch table and vm_exit_save_profiles stay writable
+	// globals that any kernel code can still patch
+	auto seal_exit_handlers() -> void;
+
+	auto exit_histogram_bucket(u64 cycles) -> u32;
+
+	// sums the exit stats of all vcpus into snapshot, without locking.
+	// copies at most size bytes and returns how many it copied
+	auto snapshot_exit_stats(exit_stats_snapshot* snapshot, u64 size) -> u64;
 }
+
+extern "C" hv::exit_save_profiles vm_exit_save_profiles;
+
+// basic exit reasons below 64 the stub may serve itself, cleared for any
+// reason whose handling was taken over
+extern "C" u64 vm_exit_fast_reasons;
+
+// offset of vcpu_t::fast, the exit stub finds it through fs
+extern "C" const u64 vm_exit_fast_offset;
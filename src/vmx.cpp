@@ -1,4 +1,5 @@
 #include "vmx.h"
+#include "vcpu.h"
 
 namespace vmx
 {
@@ -111,31 +112,33 @@ namespace vmx
 	auto read_interrupt_state() -> interrupt_state_t
 	{
 		interrupt_state_t value;
-		value.flags = static_cast<u32>(vm_read(VMCS_GUEST_INTERRUPTIBILITY_STATE));
+		value.flags = static_cast<u32>(current_vmcs().read<VMCS_GUEST_INTERRUPTIBILITY_STATE>());
 		return value;
 	}
 
 	auto write_interrupt_state(interrupt_state_t value) -> void
 	{
-		vm_write(VMCS_GUEST_INTERRUPTIBILITY_STATE, value.flags);
+		current_vmcs().write<VMCS_GUEST_INTERRUPTIBILITY_STATE>(value.flags);
 	}
 
 	auto skip_instruction() -> void
 	{
-		auto const old_rip = vm_read(VMCS_GUEST_RIP);
-		auto new_rip = old_rip + vm_read(VMCS_VMEXIT_INSTRUCTION_LENGTH);
+		auto& vmcs = current_vmcs();
+
+		auto const old_rip = vmcs.read<VMCS_GUEST_RIP>();
+		auto new_rip = old_rip + vmcs.read<VMCS_VMEXIT_INSTRUCTION_LENGTH>();
 
 		if (old_rip < (1ull << 32) && new_rip >= (1ull << 32)) {
 			vmx_segment_access_rights cs_access_rights;
 			cs_access_rights.flags = static_cast<u32>(
-				vm_read(VMCS_GUEST_CS_ACCESS_RIGHTS));
+				vmcs.read<VMCS_GUEST_CS_ACCESS_RIGHTS>());
 
 
 			if (!cs_access_rights.long_mode)
 				new_rip &= 0xFFFF'FFFF;
 		}
 		
-		vm_write(VMCS_GUEST_RIP, new_rip);
+		vmcs.write<VMCS_GUEST_RIP>(new_rip);
 
 		auto interrupt_state = read_interrupt_state();
 		interrupt_state.blocking_by_mov_ss = 0;
@@ -143,16 +146,16 @@ namespace vmx
 		write_interrupt_state(interrupt_state);
 
 		ia32_debugctl_register debugctl;
-		debugctl.flags = vm_read(VMCS_GUEST_DEBUGCTL);
+		debugctl.flags = vmcs.read<VMCS_GUEST_DEBUGCTL>();
 
 		rflags rflags;
-		rflags.flags = vm_read(VMCS_GUEST_RFLAGS);
+		rflags.flags = vmcs.read<VMCS_GUEST_RFLAGS>();
 
 		if (rflags.trap_flag && !debugctl.btf) {
 			vmx_pending_debug_exceptions dbg_exception;
-			dbg_exception.flags = vm_read(VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS);
+			dbg_exception.flags = vmcs.read<VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS>();
 			dbg_exception.bs = 1;
-			vm_write(VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS, dbg_exception.flags);
+			vmcs.write<VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS>(dbg_exception.flags);
 		}
 	}
 
@@ -199,28 +202,30 @@ namespace vmx
 	u16 current_guest_cpl()
 	{
 		vmx_segment_access_rights ss;
-		ss.flags = static_cast<uint32_t>(vm_read(VMCS_GUEST_SS_ACCESS_RIGHTS));
+		ss.flags = static_cast<uint32_t>(current_vmcs().read<VMCS_GUEST_SS_ACCESS_RIGHTS>());
 		return ss.descriptor_privilege_level;
 	}
 
 	cr4 read_effective_guest_cr4()
 	{
-		auto const mask = vm_read(VMCS_CTRL_CR4_GUEST_HOST_MASK);
+		auto& vmcs = current_vmcs();
+		auto const mask = vmcs.read<VMCS_CTRL_CR4_GUEST_HOST_MASK>();
 
 		cr4 cr4;
-		cr4.flags = (vm_read(VMCS_CTRL_CR4_READ_SHADOW) & mask)
-			| (vm_read(VMCS_GUEST_CR4) & ~mask);
+		cr4.flags = (vmcs.read<VMCS_CTRL_CR4_READ_SHADOW>() & mask)
+			| (vmcs.read<VMCS_GUEST_CR4>() & ~mask);
 
 		return cr4;
 	}
 
 	cr0 read_effective_guest_cr0()
 	{
-		auto const mask = vm_read(VMCS_CTRL_CR0_GUEST_HOST_MASK);
+		auto& vmcs = current_vmcs();
+		auto const mask = vmcs.read<VMCS_CTRL_CR0_GUEST_HOST_MASK>();
 
 		cr0 cr0;
-		cr0.flags = (vm_read(VMCS_CTRL_CR0_READ_SHADOW) & mask)
-			| (vm_read(VMCS_GUEST_CR0) & ~mask);
+		cr0.flags = (vmcs.read<VMCS_CTRL_CR0_READ_SHADOW>() & mask)
+			| (vmcs.read<VMCS_GUEST_CR0>() & ~mask);
 
 		return cr0;
 	}
@@ -228,7 +233,7 @@ namespace vmx
 	void write_guest_gpr(guest_registers* ctx, u64 gpr_idx, u64 value)
 	{
 		if (gpr_idx == VMX_EXIT_QUALIFICATION_GENREG_RSP)
-			vm_write(VMCS_GUEST_RSP, value);
+			current_vmcs().write<VMCS_GUEST_RSP>(value);
 		else
 			ctx->gpr[gpr_idx] = value;
 	}
@@ -236,7 +241,7 @@ namespace vmx
 	u64 read_guest_gpr(guest_registers* ctx, u64 gpr_idx)
 	{
 		if (gpr_idx == VMX_EXIT_QUALIFICATION_GENREG_RSP)
-			return vm_read(VMCS_GUEST_RSP);
+			return current_vmcs().read<VMCS_GUEST_RSP>();
 		return ctx->gpr[gpr_idx];
 	}
 